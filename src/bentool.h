@@ -28,8 +28,17 @@
 #include <bluetooth/hci_lib.h>
 
 #include "utils.h"
+#include "ble_idx.h"
+#include "ble_ring.h"
+#include "ble_loop.h"
 #include "ble_hci.h"
 #include "ble_pkt.h"
+#include "ble_cols.h"
 #include "ble_stream.h"
+#include "ble_cap.h"
+#include "ble_out.h"
+#include "ble_source.h"
+#include "ble_gen.h"
+#include "ble_rpa.h"
 
 #endif // __BENTOOL_H__
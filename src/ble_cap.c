@@ -0,0 +1,700 @@
+/*
+ *
+ * Adrian Brzezinski (2020) <adrian.brzezinski at adrb.pl>
+ * License: GPLv2+
+ *
+ */
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "bentool.h"
+
+typedef struct {
+
+  uint64_t recv_us;
+  uint32_t id;
+
+} ble_cap_ord_t;
+
+static int ble_cap_ord_cmp( const void *a, const void *b ) {
+
+  const ble_cap_ord_t *oa = a, *ob = b;
+
+  if ( oa->recv_us != ob->recv_us )
+    return oa->recv_us < ob->recv_us ? -1 : 1;
+
+return oa->id < ob->id ? -1 : oa->id > ob->id;
+}
+
+// Records taken by packet, first one and continuations
+static inline uint32_t ble_cap_pkt_recs( ble_pkt_t *pkt ) {
+
+  uint32_t len = pkt->data_type == BLE_ADV_INFO ? pkt->data.advinfo->length : 0;
+
+return len > BLE_CAP_DATA_MAX ? 1 + (len - BLE_CAP_DATA_MAX + BLE_CAP_ADV_SIZE - 1) / BLE_CAP_ADV_SIZE : 1;
+}
+
+// Fill up to BLE_CAP_PKT_RECS records, returns how many were used
+static uint32_t ble_cap_pkt2rec( ble_pkt_t *pkt, ble_cap_rec_t *rec ) {
+
+  le_advertising_info *info = (le_advertising_info*)rec->adv;
+  ble_cap_rec_t *cont;
+  size_t len, off, n;
+  uint32_t num = 1;
+
+  memset(rec, 0, sizeof(ble_cap_rec_t));
+
+  rec->recv_us = pkt->recv_us;
+  bacpy(&rec->bda, &pkt->bda);
+  rec->rssi = pkt->rssi;
+  rec->data_type = pkt->data_type;
+  rec->bdaddr_type = pkt->bdaddr_type;
+  rec->src = pkt->src;
+
+  switch ( pkt->data_type ) {
+
+  case BLE_ADV_INFO:
+
+    len = pkt->data.advinfo->length;
+    memcpy(info, pkt->data.advinfo, sizeof(le_advertising_info) + (len > BLE_CAP_DATA_MAX ? BLE_CAP_DATA_MAX : len));
+
+    for ( off = BLE_CAP_DATA_MAX ; off < len ; off += n ) {
+
+      n = len - off > BLE_CAP_ADV_SIZE ? BLE_CAP_ADV_SIZE : len - off;
+
+      cont = &rec[num++];
+      memset(cont, 0, sizeof(ble_cap_rec_t));
+      cont->recv_us = pkt->recv_us;
+      bacpy(&cont->bda, &pkt->bda);
+      cont->data_type = BLE_CAP_REC_CONT;
+      cont->src = pkt->src;
+      memcpy(cont->adv, pkt->data.advinfo->data + off, n);
+    }
+
+  break;
+
+  case BLE_GA_EN:
+
+    info->bdaddr_type = pkt->bdaddr_type;
+    bacpy(&info->bdaddr, &pkt->bda);
+    info->length = sizeof(ble_ga_adv_t);
+    memcpy(info->data, &pkt->data.ga, sizeof(ble_ga_adv_t));
+
+  break;
+  }
+
+return num;
+}
+
+static void ble_cap_hdr_init( ble_cap_hdr_t *hdr ) {
+
+  memset(hdr, 0, sizeof(ble_cap_hdr_t));
+  memcpy(hdr->magic, BLE_CAP_MAGIC, sizeof(BLE_CAP_MAGIC));
+  hdr->version = BLE_CAP_VERSION;
+  hdr->rec_size = sizeof(ble_cap_rec_t);
+  hdr->idx_step = BLE_CAP_IDX_STEP;
+}
+
+int ble_cap_probe( char *filename ) {
+
+  char magic[8];
+  FILE *f;
+  int ret;
+
+  if ( !(f = fopen(filename, "r")) ) return 0;
+
+  ret = fread(magic, sizeof(magic), 1, f) == 1 && !memcmp(magic, BLE_CAP_MAGIC, sizeof(BLE_CAP_MAGIC));
+
+  fclose(f);
+
+return ret;
+}
+
+int ble_cap_dump( char *filename ) {
+
+  ble_pkt_stream_t *bps;
+  ble_cap_ord_t *ord = NULL;
+  ble_cap_idx_t *idx = NULL;
+  ble_cap_hdr_t hdr;
+  ble_cap_rec_t rec[BLE_CAP_PKT_RECS];
+  uint64_t num = 0, i, idx_num, recs = 0;
+  uint32_t n, j;
+  FILE *f;
+  int ret = 0;
+
+  if ( !filename ) return -1;
+
+  if ( !(f = fopen(filename, "w")) ) {
+    perror("Couldn't create file");
+    return -1;
+  }
+
+  setvbuf(f, NULL, _IOFBF, 1 << 20);
+
+  // Collect packets from all streams and sort them by receive time
+  for ( bps = ble_stream ; bps ; bps = bps->next )
+    num += bps->cols.num;
+
+  if ( num && (ord = malloc(num * sizeof(ble_cap_ord_t))) == NULL ) {
+    perror("Could not allocate packet order");
+    exit(ENOMEM);
+  }
+
+  for ( bps = ble_stream, num = 0 ; bps ; bps = bps->next ) {
+    for ( i = 0 ; i < bps->cols.num ; i++, num++ ) {
+      ord[num].recv_us = bps->cols.ts[i];
+      ord[num].id = bps->cols.pkt[i];
+    }
+  }
+
+  qsort(ord, num, sizeof(ble_cap_ord_t), ble_cap_ord_cmp);
+
+  // index is kept for records, some packets take more than one
+  for ( i = 0 ; i < num ; i++ )
+    recs += ble_cap_pkt_recs(ble_pkt_get(ord[i].id));
+
+  idx_num = (recs + BLE_CAP_IDX_STEP - 1) / BLE_CAP_IDX_STEP;
+  if ( idx_num && (idx = malloc(idx_num * sizeof(ble_cap_idx_t))) == NULL ) {
+    perror("Could not allocate time index");
+    exit(ENOMEM);
+  }
+
+  ble_cap_hdr_init(&hdr);
+
+  fwrite(&hdr, sizeof(hdr), 1, f);
+
+  for ( i = 0, recs = 0 ; i < num ; i++ ) {
+
+    n = ble_cap_pkt2rec(ble_pkt_get(ord[i].id), rec);
+
+    for ( j = 0 ; j < n ; j++, recs++ ) {
+      if ( !(recs % BLE_CAP_IDX_STEP) ) {
+        idx[recs / BLE_CAP_IDX_STEP].recv_us = rec[j].recv_us;
+        idx[recs / BLE_CAP_IDX_STEP].rec = recs;
+      }
+    }
+
+    fwrite(rec, sizeof(ble_cap_rec_t), n, f);
+  }
+
+  // Index goes after records, header is completed at the end
+  hdr.rec_num = recs;
+  hdr.idx_off = sizeof(hdr) + recs * sizeof(ble_cap_rec_t);
+  if ( num ) {
+    hdr.first_us = ord[0].recv_us;
+    hdr.last_us = ord[num - 1].recv_us;
+  }
+
+  fwrite(idx, sizeof(ble_cap_idx_t), idx_num, f);
+
+  fseek(f, 0, SEEK_SET);
+  fwrite(&hdr, sizeof(hdr), 1, f);
+
+  if ( ferror(f) ) {
+    perror("Couldn't write file");
+    ret = -1;
+  }
+
+  if ( fclose(f) ) ret = -1;
+
+  free(idx);
+  free(ord);
+
+  if ( !ret )
+    printf("Dumped %lu packets\n", (unsigned long)num);
+
+return ret;
+}
+
+// First record received at from_us or later. Time index is searched first,
+// so only one block of records is touched.
+static uint64_t ble_cap_seek( ble_cap_rec_t *recs, uint64_t num,
+    ble_cap_idx_t *idx, uint64_t idx_num, uint64_t from_us ) {
+
+  uint64_t lo = 0, hi = num, mid;
+
+  if ( !from_us ) return 0;
+
+  if ( idx ) {
+
+    uint64_t l = 0, h = idx_num;
+
+    while ( l < h ) {
+      mid = l + (h - l)/2;
+      if ( idx[mid].recv_us < from_us ) l = mid + 1;
+      else h = mid;
+    }
+
+    if ( l > 0 ) lo = idx[l-1].rec;
+    if ( l < idx_num ) hi = idx[l].rec;
+  }
+
+  while ( lo < hi ) {
+    mid = lo + (hi - lo)/2;
+    if ( recs[mid].recv_us < from_us ) lo = mid + 1;
+    else hi = mid;
+  }
+
+return lo;
+}
+
+typedef struct {
+
+  void *map;
+  size_t map_len;
+
+  ble_cap_rec_t *recs;
+  uint64_t num;
+  uint64_t next;
+  uint64_t to_us;
+  int version;
+
+} ble_cap_source_t;
+
+// Continuation records of packet at rec, those missing at end of
+// file that wasn't closed are left out and data length is cut
+static uint32_t ble_cap_rec_cont( ble_cap_source_t *cs, uint64_t rec, uint8_t *len ) {
+
+  uint32_t want, have;
+
+  if ( cs->version < 3 && *len > BLE_CAP_DATA_MAX ) *len = BLE_CAP_DATA_MAX;
+  if ( *len <= BLE_CAP_DATA_MAX ) return 0;
+
+  want = (*len - BLE_CAP_DATA_MAX + BLE_CAP_ADV_SIZE - 1) / BLE_CAP_ADV_SIZE;
+
+  for ( have = 0 ; have < want && rec + 1 + have < cs->num &&
+        cs->recs[rec + 1 + have].data_type == BLE_CAP_REC_CONT ; have++ );
+
+  if ( have < want ) *len = BLE_CAP_DATA_MAX + have * BLE_CAP_ADV_SIZE;
+
+return have;
+}
+
+// Advertising data of record and its continuations
+static void ble_cap_rec_data( ble_cap_rec_t *rec, uint8_t *data, uint8_t len ) {
+
+  le_advertising_info *info = (le_advertising_info*)rec->adv;
+  size_t off, n;
+
+  memcpy(data, info->data, len > BLE_CAP_DATA_MAX ? BLE_CAP_DATA_MAX : len);
+
+  for ( off = BLE_CAP_DATA_MAX ; off < len ; off += n ) {
+    n = len - off > BLE_CAP_ADV_SIZE ? BLE_CAP_ADV_SIZE : len - off;
+    memcpy(data + off, (++rec)->adv, n);
+  }
+}
+
+// Records become reports again, EN data gets its advertisement back
+static int ble_cap_source_next( ble_source_t *s, ble_batch_t *batch ) {
+
+  ble_cap_source_t *cs = s->priv;
+  ble_cap_rec_t *rec;
+  le_advertising_info *info, *rep;
+  uint32_t cont;
+  uint8_t src, len;
+
+  while ( cs->next < cs->num ) {
+
+    rec = &cs->recs[cs->next];
+    if ( cs->to_us && rec->recv_us > cs->to_us ) {
+      cs->next = cs->num;
+      break;
+    }
+
+    // left from packet cut at the start of time range
+    if ( rec->data_type == BLE_CAP_REC_CONT ) {
+      cs->next++;
+      continue;
+    }
+
+    info = (le_advertising_info*)rec->adv;
+    src = cs->version > 1 ? rec->src : 0;
+    cont = 0;
+
+    if ( rec->data_type == BLE_GA_EN ) {
+      rep = ble_batch_en(batch, rec->recv_us, src, &rec->bda, rec->bdaddr_type,
+        (ble_ga_adv_t*)info->data, rec->rssi);
+    } else {
+
+      len = info->length;
+      cont = ble_cap_rec_cont(cs, cs->next, &len);
+
+      if ( (rep = ble_batch_report(batch, rec->recv_us, src, len)) ) {
+        memcpy(rep, info, sizeof(le_advertising_info));
+        rep->length = len;
+        rep->bdaddr_type = rec->bdaddr_type;
+        bacpy(&rep->bdaddr, &rec->bda);
+        ble_cap_rec_data(rec, rep->data, len);
+        rep->data[len] = rec->rssi;
+      }
+    }
+
+    if ( !rep ) break;
+
+    cs->next += 1 + cont;
+  }
+
+return batch->num;
+}
+
+static void ble_cap_source_close( ble_source_t *s ) {
+
+  ble_cap_source_t *cs = s->priv;
+
+  munmap(cs->map, cs->map_len);
+  free(cs);
+}
+
+static const ble_source_ops_t ble_cap_source_ops = {
+  .name = "capture file",
+  .next = ble_cap_source_next,
+  .close = ble_cap_source_close,
+};
+
+int ble_cap_source( ble_source_t *s, char *filename, uint64_t from_us, uint64_t to_us ) {
+
+  ble_cap_source_t *cs;
+  ble_cap_hdr_t *hdr;
+  ble_cap_idx_t *idx = NULL;
+  uint64_t idx_num = 0, first;
+  struct stat st;
+  void *map;
+  int fd;
+
+  if ( !filename ) return -1;
+
+  if ( (fd = open(filename, O_RDONLY)) < 0 ) {
+    perror("Couldn't load file");
+    return -1;
+  }
+
+  if ( fstat(fd, &st) || st.st_size < sizeof(ble_cap_hdr_t) ) {
+    fprintf(stderr, "Not a capture file\n");
+    close(fd);
+    return -1;
+  }
+
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+
+  if ( map == MAP_FAILED ) {
+    perror("Couldn't map file");
+    return -1;
+  }
+
+  hdr = map;
+  if ( memcmp(hdr->magic, BLE_CAP_MAGIC, sizeof(BLE_CAP_MAGIC)) ||
+       hdr->version < 1 || hdr->version > BLE_CAP_VERSION || hdr->rec_size != sizeof(ble_cap_rec_t) ) {
+    fprintf(stderr, "Unsupported capture file format\n");
+    munmap(map, st.st_size);
+    return -1;
+  }
+
+  if ( (cs = calloc(1, sizeof(ble_cap_source_t))) == NULL ) {
+    perror("Could not allocate capture source");
+    exit(ENOMEM);
+  }
+
+  cs->map = map;
+  cs->map_len = st.st_size;
+  cs->version = hdr->version;
+  cs->recs = (ble_cap_rec_t*)(hdr + 1);
+  cs->to_us = to_us;
+
+  // File that wasn't closed is cut at last complete record
+  cs->num = (st.st_size - sizeof(ble_cap_hdr_t)) / sizeof(ble_cap_rec_t);
+  if ( hdr->rec_num && hdr->rec_num <= cs->num ) {
+
+    cs->num = hdr->rec_num;
+
+    // index of corrupted file is ignored, records are searched without it
+    if ( hdr->idx_step && hdr->idx_off ) {
+
+      idx_num = (cs->num + hdr->idx_step - 1) / hdr->idx_step;
+
+      if ( hdr->idx_off >= sizeof(ble_cap_hdr_t) + cs->num * sizeof(ble_cap_rec_t) &&
+           hdr->idx_off <= st.st_size &&
+           idx_num <= (st.st_size - hdr->idx_off) / sizeof(ble_cap_idx_t) )
+        idx = (ble_cap_idx_t*)((uint8_t*)map + hdr->idx_off);
+      else
+        idx_num = 0;
+    }
+  }
+
+  first = ble_cap_seek(cs->recs, cs->num, idx, idx_num, from_us);
+  cs->next = first;
+
+  madvise(cs->recs + first, (cs->num - first) * sizeof(ble_cap_rec_t), MADV_SEQUENTIAL);
+
+  s->ops = &ble_cap_source_ops;
+  s->priv = cs;
+
+return 0;
+}
+
+int ble_cap_load( char *filename, uint64_t from_us, uint64_t to_us, int verbose ) {
+
+  ble_source_t s;
+
+  if ( ble_cap_source(&s, filename, from_us, to_us) < 0 )
+    return -1;
+
+return ble_source_load(&s, verbose);
+}
+
+// Write whole buffer, retrying short writes
+static int ble_cap_write( int fd, void *buf, size_t len ) {
+
+  uint8_t *p = buf;
+  ssize_t ret;
+
+  while ( len ) {
+
+    if ( (ret = write(fd, p, len)) < 0 ) {
+      if ( errno == EINTR ) continue;
+      return -1;
+    }
+
+    // no space left usually ends with short write first
+    if ( !ret ) {
+      errno = ENOSPC;
+      return -1;
+    }
+
+    p += ret;
+    len -= ret;
+  }
+
+return 0;
+}
+
+// Writer thread, takes whole batch of queued records and writes it at once
+static void* ble_cap_writer_run( void *arg ) {
+
+  ble_cap_writer_t *w = arg;
+  ble_cap_rec_t *recs;
+  uint32_t num, size, i;
+  uint64_t sync_us = mono_usec();
+  struct timespec ts;
+  int stop;
+
+  pthread_mutex_lock(&w->lock);
+
+  for (;;) {
+
+    while ( !w->stop && !w->flush && w->num < BLE_CAP_WRITER_BATCH ) {
+
+      clock_gettime(CLOCK_REALTIME, &ts);
+      ts.tv_sec += BLE_CAP_WRITER_FLUSH;
+
+      if ( pthread_cond_timedwait(&w->cond, &w->lock, &ts) == ETIMEDOUT )
+        break;
+    }
+
+    // swap queue with spare buffer
+    recs = w->recs;
+    num = w->num;
+    size = w->size;
+    stop = w->stop;
+
+    w->flush = 0;
+    w->recs = w->spare;
+    w->size = w->spare_size;
+    w->num = 0;
+
+    pthread_mutex_unlock(&w->lock);
+
+    // after write error records are dropped, file stays readable up to last complete one
+    if ( num && !w->error ) {
+
+      if ( ble_cap_write(w->fd, recs, num * sizeof(ble_cap_rec_t)) < 0 ) {
+
+        perror("Couldn't write capture file");
+        w->error = 1;
+
+        if ( ftruncate(w->fd, sizeof(ble_cap_hdr_t) + w->written * sizeof(ble_cap_rec_t)) )
+          perror("Couldn't truncate capture file");
+
+        num = 0;
+      }
+    }
+
+    if ( num ) {
+
+      // records arrive in time order, so index can be built on the fly
+      for ( i = 0 ; i < num ; i++, w->written++ ) {
+
+        if ( !(w->written % BLE_CAP_IDX_STEP) ) {
+
+          if ( w->idx_num == w->idx_size ) {
+            w->idx_size = w->idx_size ? w->idx_size << 1 : 64;
+            if ( (w->idx = realloc(w->idx, w->idx_size * sizeof(ble_cap_idx_t))) == NULL ) {
+              perror("Could not allocate time index");
+              exit(ENOMEM);
+            }
+          }
+
+          w->idx[w->idx_num].recv_us = recs[i].recv_us;
+          w->idx[w->idx_num++].rec = w->written;
+        }
+
+        if ( !w->written ) w->first_us = recs[i].recv_us;
+      }
+
+      w->last_us = recs[num - 1].recv_us;
+    }
+
+    if ( stop || mono_usec() - sync_us >= BLE_CAP_WRITER_SYNC * 1000000ULL ) {
+      fdatasync(w->fd);
+      sync_us = mono_usec();
+    }
+
+    pthread_mutex_lock(&w->lock);
+
+    w->spare = recs;
+    w->spare_size = size;
+
+    if ( stop && !w->num ) break;
+  }
+
+  pthread_mutex_unlock(&w->lock);
+
+return NULL;
+}
+
+ble_cap_writer_t* ble_cap_writer_open( char *filename ) {
+
+  ble_cap_writer_t *w;
+  ble_cap_hdr_t hdr;
+
+  if ( (w = calloc(1, sizeof(ble_cap_writer_t))) == NULL ) {
+    perror("Could not allocate capture writer");
+    exit(ENOMEM);
+  }
+
+  if ( (w->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0 ) {
+    perror("Couldn't create capture file");
+    free(w);
+    return NULL;
+  }
+
+  // Record count stays zero until file is closed
+  ble_cap_hdr_init(&hdr);
+
+  if ( write(w->fd, &hdr, sizeof(hdr)) != sizeof(hdr) ) {
+    perror("Couldn't write capture file");
+    close(w->fd);
+    free(w);
+    return NULL;
+  }
+
+  pthread_mutex_init(&w->lock, NULL);
+  pthread_cond_init(&w->cond, NULL);
+
+  if ( pthread_create(&w->thread, NULL, ble_cap_writer_run, w) ) {
+    perror("Couldn't start capture writer");
+    close(w->fd);
+    free(w);
+    return NULL;
+  }
+
+return w;
+}
+
+// Queue packet, doesn't wait for disk
+void ble_cap_writer_add( ble_cap_writer_t *w, ble_pkt_t *pkt ) {
+
+  uint32_t num;
+
+  if ( !w ) return;
+
+  pthread_mutex_lock(&w->lock);
+
+  // grow queue if writer lags behind
+  if ( w->num + BLE_CAP_PKT_RECS > w->size ) {
+
+    w->size = w->size ? w->size << 1 : BLE_CAP_WRITER_BATCH << 1;
+
+    if ( (w->recs = realloc(w->recs, w->size * sizeof(ble_cap_rec_t))) == NULL ) {
+      perror("Could not allocate capture queue");
+      exit(ENOMEM);
+    }
+  }
+
+  num = w->num;
+  w->num += ble_cap_pkt2rec(pkt, &w->recs[w->num]);
+  w->pkts++;
+
+  if ( num < BLE_CAP_WRITER_BATCH && w->num >= BLE_CAP_WRITER_BATCH )
+    pthread_cond_signal(&w->cond);
+
+  pthread_mutex_unlock(&w->lock);
+}
+
+// Write queued records now instead of waiting for full batch
+void ble_cap_writer_flush( ble_cap_writer_t *w ) {
+
+  if ( !w ) return;
+
+  pthread_mutex_lock(&w->lock);
+  if ( w->num ) {
+    w->flush = 1;
+    pthread_cond_signal(&w->cond);
+  }
+  pthread_mutex_unlock(&w->lock);
+}
+
+// Flush queued records, write time index and complete header
+int ble_cap_writer_close( ble_cap_writer_t *w ) {
+
+  ble_cap_hdr_t hdr;
+  int ret;
+
+  if ( !w ) return 0;
+
+  pthread_mutex_lock(&w->lock);
+  w->stop = 1;
+  pthread_cond_signal(&w->cond);
+  pthread_mutex_unlock(&w->lock);
+
+  pthread_join(w->thread, NULL);
+
+  // incomplete file is left without index, it's read up to last complete record
+  if ( !w->error ) {
+
+    ble_cap_hdr_init(&hdr);
+    hdr.rec_num = w->written;
+    hdr.idx_off = sizeof(hdr) + w->written * sizeof(ble_cap_rec_t);
+    hdr.first_us = w->first_us;
+    hdr.last_us = w->last_us;
+
+    if ( w->idx_num )
+      w->error |= ble_cap_write(w->fd, w->idx, w->idx_num * sizeof(ble_cap_idx_t)) < 0;
+
+    if ( !w->error )
+      w->error |= pwrite(w->fd, &hdr, sizeof(hdr), 0) != sizeof(hdr);
+
+    w->error |= fdatasync(w->fd) != 0;
+  }
+
+  w->error |= close(w->fd) != 0;
+
+  if ( w->error )
+    fprintf(stderr, "Capture file is incomplete\n");
+  else
+    printf("Written %lu packets to capture file\n", (unsigned long)w->pkts);
+
+  ret = w->error ? -1 : 0;
+
+  pthread_mutex_destroy(&w->lock);
+  pthread_cond_destroy(&w->cond);
+
+  free(w->recs);
+  free(w->spare);
+  free(w->idx);
+  free(w);
+
+return ret;
+}
@@ -0,0 +1,125 @@
+/*
+ *
+ * Adrian Brzezinski (2020) <adrian.brzezinski at adrb.pl>
+ * License: GPLv2+
+ *
+ */
+
+#ifndef __BLE_CAP_H__
+#define __BLE_CAP_H__
+
+#include <stdint.h>
+#include <pthread.h>
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+
+#include "ble_pkt.h"
+
+// Binary capture file:
+//
+//  header | records sorted by receive time | sparse time index
+//
+// All fields are in host byte order. Records have fixed size, so file
+// can be mapped and addressed directly. Time index holds receive time of
+// every BLE_CAP_IDX_STEP record and is written when file is closed.
+//
+// Advertising data longer than BLE_CAP_DATA_MAX continues in records that
+// follow, with the same receive time and BLE_CAP_REC_CONT data type. They
+// carry only data, in adv field. Length in le_advertising_info is the whole.
+#define BLE_CAP_MAGIC "BENTCAP"
+#define BLE_CAP_VERSION 3   // version 1 had no source index, it's read as source 0,
+                            // version 2 cut data at BLE_CAP_DATA_MAX
+
+#define BLE_CAP_REC_SIZE 64
+#define BLE_CAP_ADV_SIZE (BLE_CAP_REC_SIZE - 17)
+#define BLE_CAP_DATA_MAX (BLE_CAP_ADV_SIZE - sizeof(le_advertising_info))   // in first record
+#define BLE_CAP_REC_CONT 0xf
+#define BLE_CAP_PKT_RECS (1 + (255 - BLE_CAP_DATA_MAX + BLE_CAP_ADV_SIZE - 1) / BLE_CAP_ADV_SIZE)   // max per packet
+#define BLE_CAP_IDX_STEP 1024
+
+typedef struct {
+
+  char magic[8];
+  uint16_t version;
+  uint16_t rec_size;
+  uint32_t idx_step;
+
+  uint64_t rec_num;     // 0 if file wasn't closed, use file size then
+  uint64_t idx_off;     // 0 if there is no time index
+  uint64_t first_us;
+  uint64_t last_us;
+
+  uint8_t reserved[16];
+
+} __attribute__ ((packed)) ble_cap_hdr_t;
+
+typedef struct {
+
+  uint64_t recv_us;
+  bdaddr_t bda;
+  int8_t rssi;
+  uint8_t data_type:4;  // ble_pkt_data_type or BLE_CAP_REC_CONT
+  uint8_t bdaddr_type:4;
+
+  // le_advertising_info followed by advertising data,
+  // GA packets keep ble_ga_adv_t as data
+  uint8_t adv[BLE_CAP_ADV_SIZE];
+
+  uint8_t src;          // capture source (adapter) index
+
+} __attribute__ ((packed)) ble_cap_rec_t;
+
+typedef struct {
+
+  uint64_t recv_us;
+  uint64_t rec;
+
+} ble_cap_idx_t;
+
+// Appends records to capture file while scanning. Records are queued by
+// scan loop and written in batches by background thread, data is synced
+// to disk every BLE_CAP_WRITER_SYNC seconds. File without completed header
+// is still readable up to last complete record.
+#define BLE_CAP_WRITER_BATCH 4096
+#define BLE_CAP_WRITER_FLUSH 1    // max seconds before queued records are written, unless flushed
+#define BLE_CAP_WRITER_SYNC 5
+
+typedef struct {
+
+  int fd;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int stop;
+  int flush;
+  int error;
+
+  ble_cap_rec_t *recs;    // queue filled by scan loop
+  uint32_t num;
+  uint32_t size;
+
+  ble_cap_rec_t *spare;   // buffer being written
+  uint32_t spare_size;
+
+  uint64_t pkts;          // queued, long ones take more records
+
+  // owned by writer thread
+  uint64_t written;
+  uint64_t first_us;
+  uint64_t last_us;
+  ble_cap_idx_t *idx;
+  uint64_t idx_num;
+  uint64_t idx_size;
+
+} ble_cap_writer_t;
+
+ble_cap_writer_t* ble_cap_writer_open( char *filename );
+void ble_cap_writer_add( ble_cap_writer_t *w, ble_pkt_t *pkt );
+void ble_cap_writer_flush( ble_cap_writer_t *w );
+int ble_cap_writer_close( ble_cap_writer_t *w );
+
+int ble_cap_probe( char *filename );   // returns 1 for binary capture
+int ble_cap_dump( char *filename );
+int ble_cap_load( char *filename, uint64_t from_us, uint64_t to_us, int verbose );
+
+#endif // __BLE_CAP_H__
@@ -0,0 +1,259 @@
+/*
+ *
+ * Adrian Brzezinski (2020) <adrian.brzezinski at adrb.pl>
+ * License: GPLv2+
+ *
+ */
+
+#include "bentool.h"
+
+// Every BT address referred by columns, columns refer to it by index.
+// Address is dropped when last packet with it is gone, its slot is reused.
+bdaddr_t *ble_addr_tab = NULL;
+uint32_t *ble_addr_refs = NULL;     // column entries with address
+uint32_t ble_addr_num = 0, ble_addr_size = 0;
+uint32_t *ble_addr_holes = NULL;    // unused slots
+uint32_t ble_addr_holes_num = 0, ble_addr_holes_size = 0;
+ble_idx_t ble_addr_map = { .key_len = sizeof(bdaddr_t) };   // address -> index + 1
+
+// Index of address, every call takes reference released by ble_addr_unref()
+uint32_t ble_addr_idx( bdaddr_t *bda ) {
+
+  uintptr_t idx;
+  uint32_t i;
+
+  if ( (idx = (uintptr_t)ble_idx_get(&ble_addr_map, bda)) ) {
+    ble_addr_refs[idx - 1]++;
+    return idx - 1;
+  }
+
+  if ( ble_addr_holes_num ) {
+
+    i = ble_addr_holes[--ble_addr_holes_num];
+
+  } else {
+
+    if ( ble_addr_num == ble_addr_size ) {
+
+      ble_addr_size = ble_addr_size ? ble_addr_size << 1 : 1024;
+
+      if ( (ble_addr_tab = realloc(ble_addr_tab, ble_addr_size * sizeof(bdaddr_t))) == NULL ||
+           (ble_addr_refs = realloc(ble_addr_refs, ble_addr_size * sizeof(uint32_t))) == NULL ) {
+        perror("Could not allocate address table");
+        exit(ENOMEM);
+      }
+    }
+
+    i = ble_addr_num++;
+  }
+
+  bacpy(&ble_addr_tab[i], bda);
+  ble_addr_refs[i] = 1;
+  ble_idx_set(&ble_addr_map, bda, (void*)(uintptr_t)(i + 1));
+
+return i;
+}
+
+void ble_addr_unref( uint32_t idx ) {
+
+  // whole table could be already released
+  if ( idx >= ble_addr_num || --ble_addr_refs[idx] ) return;
+
+  ble_idx_del(&ble_addr_map, &ble_addr_tab[idx], (void*)(uintptr_t)(idx + 1));
+
+  if ( ble_addr_holes_num == ble_addr_holes_size ) {
+
+    ble_addr_holes_size = ble_addr_holes_size ? ble_addr_holes_size << 1 : 1024;
+
+    if ( (ble_addr_holes = realloc(ble_addr_holes, ble_addr_holes_size * sizeof(uint32_t))) == NULL ) {
+      perror("Could not allocate address table");
+      exit(ENOMEM);
+    }
+  }
+
+  ble_addr_holes[ble_addr_holes_num++] = idx;
+}
+
+bdaddr_t* ble_addr_get( uint32_t idx ) {
+
+  if ( idx >= ble_addr_num ) return NULL;
+
+return &ble_addr_tab[idx];
+}
+
+// Memory of address table with its index
+size_t ble_addr_mem() {
+  return (size_t)ble_addr_size * (sizeof(bdaddr_t) + sizeof(uint32_t)) +
+    ble_addr_holes_size * sizeof(uint32_t) + ble_idx_mem(&ble_addr_map);
+}
+
+void ble_addr_free() {
+
+  free(ble_addr_tab);
+  free(ble_addr_refs);
+  free(ble_addr_holes);
+  ble_addr_tab = NULL;
+  ble_addr_refs = NULL;
+  ble_addr_holes = NULL;
+  ble_addr_num = ble_addr_size = 0;
+  ble_addr_holes_num = ble_addr_holes_size = 0;
+
+  ble_idx_free(&ble_addr_map);
+}
+
+static void ble_cols_resize( ble_cols_t *cols, uint32_t size ) {
+
+  if ( (cols->ts = realloc(cols->ts, size * sizeof(uint64_t))) == NULL ||
+       (cols->rssi = realloc(cols->rssi, size * sizeof(int8_t))) == NULL ||
+       (cols->bda = realloc(cols->bda, size * sizeof(uint32_t))) == NULL ||
+       (cols->pkt = realloc(cols->pkt, size * sizeof(uint32_t))) == NULL ) {
+    perror("Could not allocate stream columns");
+    exit(ENOMEM);
+  }
+
+  cols->size = size;
+}
+
+static void ble_cols_release( ble_cols_t *cols ) {
+
+  free(cols->ts);
+  free(cols->rssi);
+  free(cols->bda);
+  free(cols->pkt);
+
+  memset(cols, 0, sizeof(ble_cols_t));
+}
+
+void ble_cols_push( ble_cols_t *cols, ble_pkt_t *pkt ) {
+
+  uint32_t i = cols->num;
+
+  if ( i == cols->size )
+    ble_cols_resize(cols, cols->size ? cols->size << 1 : BLE_COLS_INIT);
+
+  cols->ts[i] = pkt->recv_us;
+  cols->rssi[i] = pkt->rssi;
+  cols->bda[i] = ble_addr_idx(&pkt->bda);
+  cols->pkt[i] = pkt->id;
+
+  cols->num++;
+}
+
+// Put older packets in front of newer ones, older columns are moved to newer
+void ble_cols_join( ble_cols_t *older, ble_cols_t *newer ) {
+
+  uint32_t num = older->num + newer->num;
+
+  if ( num > older->size )
+    ble_cols_resize(older, num);
+
+  memcpy(older->ts + older->num, newer->ts, newer->num * sizeof(uint64_t));
+  memcpy(older->rssi + older->num, newer->rssi, newer->num * sizeof(int8_t));
+  memcpy(older->bda + older->num, newer->bda, newer->num * sizeof(uint32_t));
+  memcpy(older->pkt + older->num, newer->pkt, newer->num * sizeof(uint32_t));
+
+  older->num = num;
+
+  // addresses moved along with packets, they keep their references
+  ble_cols_release(newer);
+
+  *newer = *older;
+  memset(older, 0, sizeof(ble_cols_t));
+}
+
+// Remove num oldest packets, memory is given back when columns get mostly empty
+void ble_cols_drop( ble_cols_t *cols, uint32_t num ) {
+
+  uint32_t left, size;
+
+  if ( num > cols->num ) num = cols->num;
+  if ( !num ) return;
+
+  left = cols->num - num;
+
+  for ( uint32_t i = 0 ; i < num ; i++ )
+    ble_addr_unref(cols->bda[i]);
+
+  memmove(cols->ts, cols->ts + num, left * sizeof(uint64_t));
+  memmove(cols->rssi, cols->rssi + num, left * sizeof(int8_t));
+  memmove(cols->bda, cols->bda + num, left * sizeof(uint32_t));
+  memmove(cols->pkt, cols->pkt + num, left * sizeof(uint32_t));
+
+  cols->num = left;
+
+  // streams left with few packets shouldn't keep their peak capacity
+  for ( size = cols->size ; size > BLE_COLS_MIN && left < size >> 2 ; size >>= 1 );
+
+  if ( size != cols->size )
+    ble_cols_resize(cols, size);
+}
+
+// Number of packets received before ts
+uint32_t ble_cols_lower( ble_cols_t *cols, uint64_t ts ) {
+
+  uint32_t lo = 0, hi = cols->num, mid;
+
+  while ( lo < hi ) {
+    mid = lo + (hi - lo)/2;
+    if ( cols->ts[mid] < ts ) lo = mid + 1;
+    else hi = mid;
+  }
+
+return lo;
+}
+
+void ble_cols_free( ble_cols_t *cols ) {
+
+  for ( uint32_t i = 0 ; i < cols->num ; i++ )
+    ble_addr_unref(cols->bda[i]);
+
+  ble_cols_release(cols);
+}
+
+// Memory taken by columns, with unused capacity
+size_t ble_cols_mem( ble_cols_t *cols ) {
+  return (size_t)cols->size * BLE_COLS_PKT_SIZE;
+}
+
+// Loops below are kept branchless, so compiler can vectorize them
+void ble_cols_stats( ble_cols_t *cols, ble_cols_stats_t *stats ) {
+
+  uint64_t gap_usum = 0;
+  uint32_t gaps = 0, changes = 0;
+  int64_t rssi_sum = 0;
+  int rssi_min = 127, rssi_max = -128;
+  uint32_t i, n = cols->num;
+
+  memset(stats, 0, sizeof(ble_cols_stats_t));
+
+  if ( !n ) return;
+
+  for ( i = 1 ; i < n ; i++ ) {
+
+    uint64_t gap = cols->ts[i] - cols->ts[i-1];
+    int ok = gap <= BLE_PKT_GAP_MAX;
+
+    gap_usum += ok ? gap : 0;
+    gaps += ok;
+  }
+
+  for ( i = 0 ; i < n ; i++ ) {
+
+    int rssi = cols->rssi[i];
+
+    rssi_sum += rssi;
+    rssi_min = rssi < rssi_min ? rssi : rssi_min;
+    rssi_max = rssi > rssi_max ? rssi : rssi_max;
+  }
+
+  for ( i = 1 ; i < n ; i++ )
+    changes += cols->bda[i] != cols->bda[i-1];
+
+  stats->pkts = n;
+  stats->gaps = gaps;
+  stats->gap_usum = gap_usum;
+  stats->rssi_min = rssi_min;
+  stats->rssi_max = rssi_max;
+  stats->rssi_avg = (double)rssi_sum / n;
+  stats->bda_changes = changes;
+}
@@ -0,0 +1,63 @@
+/*
+ *
+ * Adrian Brzezinski (2020) <adrian.brzezinski at adrb.pl>
+ * License: GPLv2+
+ *
+ */
+
+#ifndef __BLE_COLS_H__
+#define __BLE_COLS_H__
+
+#include <stdint.h>
+#include <bluetooth/bluetooth.h>
+
+#include "ble_pkt.h"
+
+#define BLE_COLS_INIT 64   // packets, columns grow by doubling
+#define BLE_COLS_MIN 4     // columns shrink down to that when packets are dropped
+#define BLE_COLS_PKT_SIZE (sizeof(uint64_t) + sizeof(int8_t) + 2*sizeof(uint32_t))
+
+// Packets of a stream in order of receiptment, stored column by column,
+// so loops over single field touch only contiguous memory
+typedef struct {
+
+  uint32_t num;
+  uint32_t size;
+
+  uint64_t *ts;       // receive time in usec
+  int8_t *rssi;
+  uint32_t *bda;      // index in capture address table
+  uint32_t *pkt;      // index of packet record holding payload
+
+} ble_cols_t;
+
+typedef struct {
+
+  uint32_t pkts;
+  uint32_t gaps;          // gaps shorter than BLE_PKT_GAP_MAX
+  uint64_t gap_usum;
+
+  int rssi_min;
+  int rssi_max;
+  double rssi_avg;
+
+  uint32_t bda_changes;
+
+} ble_cols_stats_t;
+
+uint32_t ble_addr_idx( bdaddr_t *bda );
+void ble_addr_unref( uint32_t idx );
+bdaddr_t* ble_addr_get( uint32_t idx );
+size_t ble_addr_mem();
+void ble_addr_free();
+
+void ble_cols_push( ble_cols_t *cols, ble_pkt_t *pkt );
+void ble_cols_join( ble_cols_t *older, ble_cols_t *newer );
+void ble_cols_drop( ble_cols_t *cols, uint32_t num );
+uint32_t ble_cols_lower( ble_cols_t *cols, uint64_t ts );
+void ble_cols_free( ble_cols_t *cols );
+size_t ble_cols_mem( ble_cols_t *cols );
+
+void ble_cols_stats( ble_cols_t *cols, ble_cols_stats_t *stats );
+
+#endif // __BLE_COLS_H__
@@ -0,0 +1,632 @@
+/*
+ *
+ * Adrian Brzezinski (2020) <adrian.brzezinski at adrb.pl>
+ * License: GPLv2+
+ *
+ */
+
+#include <math.h>
+
+#include "bentool.h"
+
+typedef struct {
+
+  uint64_t rng;           // own random stream, so devices don't depend on each other
+  uint64_t next_us;       // next advertisement
+  uint64_t rotate_us;     // next address change
+  uint64_t rpi_us;        // pending RPI change, 0 if none
+  uint64_t leave_us;
+
+  uint32_t epoch;
+  double rssi;
+
+  bdaddr_t bda;
+  uint8_t rpi[16];
+  uint8_t aem[4];
+
+} ble_gen_dev_t;
+
+typedef struct {
+
+  ble_gen_params_t gp;
+
+  ble_gen_dev_t *devs;
+  uint32_t *heap;         // devices ordered by next advertisement
+  uint32_t heap_num;
+
+  uint64_t end_us;        // 0 is no limit
+  uint64_t emitted;
+
+} ble_gen_t;
+
+void ble_gen_defaults( ble_gen_params_t *gp ) {
+
+  memset(gp, 0, sizeof(ble_gen_params_t));
+
+  gp->seed = BLE_GEN_SEED;
+  gp->devices = BLE_GEN_DEVICES;
+  gp->duration_s = BLE_GEN_DURATION_S;
+  gp->interval_ms = BLE_GEN_INTERVAL_MS;
+  gp->jitter_ms = BLE_GEN_JITTER_MS;
+  gp->rotate_s = BLE_GEN_ROTATE_S;
+  gp->drift = BLE_GEN_DRIFT;
+  gp->loss = BLE_GEN_LOSS;
+  gp->start_us = BLE_GEN_START_S * 1000000ULL;
+}
+
+// splitmix64
+static uint64_t ble_gen_rand( uint64_t *state ) {
+
+  uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+
+return z ^ (z >> 31);
+}
+
+// Uniform in [0, 1)
+static double ble_gen_unit( uint64_t *state ) {
+  return (ble_gen_rand(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static void ble_gen_bytes( uint64_t *state, uint8_t *buf, size_t len ) {
+
+  uint64_t r = 0;
+
+  for ( size_t i = 0 ; i < len ; i++, r >>= 8 ) {
+    if ( !(i & 7) ) r = ble_gen_rand(state);
+    buf[i] = r;
+  }
+}
+
+static void ble_truth_add( ble_truth_t *t, bdaddr_t *bda, uint32_t device, uint32_t epoch ) {
+
+  ble_truth_addr_t *a;
+
+  if ( t->num == t->size ) {
+
+    t->size = t->size ? t->size << 1 : 1024;
+
+    if ( (t->addrs = realloc(t->addrs, t->size * sizeof(ble_truth_addr_t))) == NULL ) {
+      perror("Could not allocate ground truth");
+      exit(ENOMEM);
+    }
+  }
+
+  a = &t->addrs[t->num++];
+  bacpy(&a->bda, bda);
+  a->device = device;
+  a->epoch = epoch;
+  a->seen = 0;
+
+  ble_idx_set(&t->map, bda, (void*)(uintptr_t)t->num);
+
+  if ( device >= t->devices ) t->devices = device + 1;
+}
+
+// Random private address, two top bits 01
+static void ble_gen_addr( ble_gen_t *g, uint32_t i ) {
+
+  ble_gen_dev_t *d = &g->devs[i];
+
+  ble_gen_bytes(&d->rng, d->bda.b, sizeof(d->bda.b));
+  d->bda.b[5] = (d->bda.b[5] & 0x3f) | 0x40;
+
+  if ( g->gp.truth )
+    ble_truth_add(g->gp.truth, &d->bda, i, d->epoch);
+}
+
+static void ble_gen_rpi( ble_gen_dev_t *d ) {
+
+  ble_gen_bytes(&d->rng, d->rpi, sizeof(d->rpi));
+  ble_gen_bytes(&d->rng, d->aem, sizeof(d->aem));
+}
+
+static inline int ble_gen_before( ble_gen_t *g, uint32_t a, uint32_t b ) {
+  return g->devs[a].next_us < g->devs[b].next_us || (g->devs[a].next_us == g->devs[b].next_us && a < b);
+}
+
+static void ble_gen_sift( ble_gen_t *g, uint32_t i ) {
+
+  uint32_t c, top = g->heap[i];
+
+  for ( ; (c = 2 * i + 1) < g->heap_num ; i = c ) {
+
+    if ( c + 1 < g->heap_num && ble_gen_before(g, g->heap[c+1], g->heap[c]) ) c++;
+    if ( !ble_gen_before(g, g->heap[c], top) ) break;
+
+    g->heap[i] = g->heap[c];
+  }
+
+  g->heap[i] = top;
+}
+
+// Next advertisement of all devices goes to batch
+static int ble_gen_next( ble_source_t *s, ble_batch_t *batch ) {
+
+  ble_gen_t *g = s->priv;
+  ble_gen_params_t *gp = &g->gp;
+  ble_gen_dev_t *d;
+  ble_ga_adv_t ga;
+  uint64_t t;
+  uint32_t i;
+
+  memset(&ga, 0, sizeof(ga));
+  ga.length = 0x17;
+  ga.type = 0x16;
+  ga.uuid = 0xfd6f;
+
+  while ( g->heap_num && (!gp->reports || g->emitted < gp->reports) &&
+          ble_batch_room(batch, 1, sizeof(le_advertising_info) + 4 + sizeof(ble_ga_adv_t) + 1) ) {
+
+    i = g->heap[0];
+    d = &g->devs[i];
+    t = d->next_us;
+
+    // device is gone
+    if ( (g->end_us && t >= g->end_us) || t >= d->leave_us ) {
+      g->heap[0] = g->heap[--g->heap_num];
+      if ( g->heap_num ) ble_gen_sift(g, 0);
+      continue;
+    }
+
+    if ( t >= d->rotate_us ) {
+
+      d->epoch++;
+      ble_gen_addr(g, i);
+      d->rotate_us += gp->rotate_s * 1000000ULL;
+
+      if ( gp->lag_ms )
+        d->rpi_us = t + gp->lag_ms * 1000ULL;
+      else
+        ble_gen_rpi(d);
+    }
+
+    if ( d->rpi_us && t >= d->rpi_us ) {
+      ble_gen_rpi(d);
+      d->rpi_us = 0;
+    }
+
+    d->rssi += (ble_gen_unit(&d->rng) * 2 - 1) * gp->drift;
+    if ( d->rssi < BLE_GEN_RSSI_MIN ) d->rssi = BLE_GEN_RSSI_MIN;
+    if ( d->rssi > BLE_GEN_RSSI_MAX ) d->rssi = BLE_GEN_RSSI_MAX;
+
+    if ( ble_gen_unit(&d->rng) >= gp->loss ) {
+
+      memcpy(ga.rpi, d->rpi, sizeof(ga.rpi));
+      memcpy(ga.aem, d->aem, sizeof(ga.aem));
+
+      ble_batch_en(batch, t, 0, &d->bda, LE_RANDOM_ADDRESS, &ga, (int8_t)lround(d->rssi));
+      g->emitted++;
+    }
+
+    d->next_us = t + gp->interval_ms * 1000ULL + (uint64_t)(ble_gen_unit(&d->rng) * gp->jitter_ms * 1000.0);
+    ble_gen_sift(g, 0);
+  }
+
+return batch->num;
+}
+
+static void ble_gen_close( ble_source_t *s ) {
+
+  ble_gen_t *g = s->priv;
+
+  free(g->devs);
+  free(g->heap);
+  free(g);
+}
+
+static const ble_source_ops_t ble_gen_ops = {
+  .name = "generator",
+  .next = ble_gen_next,
+  .close = ble_gen_close,
+};
+
+int ble_gen_source( ble_source_t *s, ble_gen_params_t *gp ) {
+
+  ble_gen_t *g;
+  ble_gen_dev_t *d;
+  struct timeval tv;
+  double arrive;
+  uint64_t start_us;
+
+  if ( !gp->devices || !gp->interval_ms || !gp->rotate_s ) {
+    fprintf(stderr, "Generator needs at least one device, interval and rotation period\n");
+    return -1;
+  }
+
+  if ( !gp->reports && !gp->duration_s ) {
+    fprintf(stderr, "Generator needs duration or number of reports\n");
+    return -1;
+  }
+
+  if ( gp->loss < 0 || gp->loss >= 1 || gp->drift < 0 ) {
+    fprintf(stderr, "Invalid packet loss or RSSI drift\n");
+    return -1;
+  }
+
+  if ( (g = calloc(1, sizeof(ble_gen_t))) == NULL ||
+       (g->devs = calloc(gp->devices, sizeof(ble_gen_dev_t))) == NULL ||
+       (g->heap = calloc(gp->devices, sizeof(uint32_t))) == NULL ) {
+    perror("Could not allocate generator");
+    exit(ENOMEM);
+  }
+
+  g->gp = *gp;
+
+  if ( !(start_us = gp->start_us) ) {
+    gettimeofday(&tv, NULL);
+    start_us = tvusec(&tv);
+  }
+
+  if ( gp->duration_s )
+    g->end_us = start_us + gp->duration_s * 1000000ULL;
+
+  for ( uint32_t i = 0 ; i < gp->devices ; i++ ) {
+
+    d = &g->devs[i];
+    d->rng = gp->seed ^ ((i + 1ULL) * 0xd1b54a32d192ed03ULL);
+
+    // devices come and go, everyone is around for stay_s
+    arrive = 0;
+    d->leave_us = UINT64_MAX;
+
+    if ( gp->stay_s && gp->duration_s ) {
+      arrive = ble_gen_unit(&d->rng) * (gp->duration_s + gp->stay_s) - gp->stay_s;
+      d->leave_us = start_us + (arrive + gp->stay_s) * 1000000.0;
+      if ( arrive < 0 ) arrive = 0;
+    }
+
+    // random phase of advertising and address rotation
+    d->next_us = start_us + arrive * 1000000.0 + ble_gen_unit(&d->rng) * gp->interval_ms * 1000.0;
+    d->rotate_us = d->next_us + ble_gen_unit(&d->rng) * gp->rotate_s * 1000000.0;
+    d->rssi = -95 + ble_gen_unit(&d->rng) * 50;
+
+    ble_gen_addr(g, i);
+    ble_gen_rpi(d);
+
+    g->heap[i] = i;
+  }
+
+  g->heap_num = gp->devices;
+  for ( uint32_t i = g->heap_num / 2 ; i-- > 0 ; )
+    ble_gen_sift(g, i);
+
+  s->ops = &ble_gen_ops;
+  s->priv = g;
+
+return 0;
+}
+
+// Reports go to capture file only, packets are released as soon as they are queued
+static int ble_gen_write( ble_source_t *s, char *filename, uint64_t *reports ) {
+
+  ble_cap_writer_t *w;
+  ble_batch_t *batch;
+  ble_pkt_t *pkt;
+  int num, ret;
+
+  if ( (w = ble_cap_writer_open(filename)) == NULL )
+    return -1;
+
+  if ( (batch = malloc(sizeof(ble_batch_t))) == NULL ) {
+    perror("Could not allocate report batch");
+    exit(ENOMEM);
+  }
+
+  while ( (num = ble_source_next(s, batch)) > 0 ) {
+
+    for ( int i = 0 ; i < num ; i++ ) {
+
+      if ( (pkt = ble_info2pkt(batch->reps[i].info, batch->reps[i].recv_us)) == NULL ) {
+        num = -1;
+        break;
+      }
+
+      pkt->src = batch->reps[i].src;
+      ble_cap_writer_add(w, pkt);
+      ble_pkt_release(pkt);
+    }
+
+    *reports += num > 0 ? num : 0;
+    if ( num < 0 ) break;
+  }
+
+  free(batch);
+
+  ret = ble_cap_writer_close(w);
+
+return num < 0 ? -1 : ret;
+}
+
+static int ble_truth_write( ble_truth_t *t, char *filename ) {
+
+  char addr[18];
+  FILE *f;
+
+  if ( !(f = fopen(filename, "w")) ) {
+    perror("Couldn't create file");
+    return -1;
+  }
+
+  for ( uint32_t i = 0 ; i < t->num ; i++ ) {
+    ba2str(&t->addrs[i].bda, addr);
+    fprintf(f, "%s,%u,%u\n", addr, t->addrs[i].device, t->addrs[i].epoch);
+  }
+
+  if ( fclose(f) ) {
+    perror("Couldn't write file");
+    return -1;
+  }
+
+return 0;
+}
+
+// Generate reports to capture file with ground truth next to it (FILE.truth),
+// or straight into streams, then track them and score the result
+int ble_gen( ble_gen_params_t *gp, char *filename ) {
+
+  ble_truth_t truth;
+  ble_source_t s;
+  ble_ingest_t ing;
+  char *truthfile;
+  uint64_t start_us, elapsed;
+  int ret;
+
+  ble_truth_init(&truth);
+  gp->truth = &truth;
+
+  if ( ble_gen_source(&s, gp) < 0 ) {
+    ble_truth_free(&truth);
+    return -1;
+  }
+
+  memset(&ing, 0, sizeof(ing));
+
+  if ( filename ) {
+
+    ret = ble_gen_write(&s, filename, &ing.pkts);
+    ble_source_close(&s);
+
+    if ( (truthfile = malloc(strlen(filename) + sizeof(".truth"))) == NULL ) {
+      perror("Could not allocate file name");
+      exit(ENOMEM);
+    }
+    sprintf(truthfile, "%s.truth", filename);
+
+    if ( !ret && !(ret = ble_truth_write(&truth, truthfile)) )
+      printf("Generated %lu reports of %u devices, ground truth of %u addresses written to %s\n",
+        (unsigned long)ing.pkts, truth.devices, truth.num, truthfile);
+
+    free(truthfile);
+
+  } else {
+
+    ble_stream_free();
+
+    start_us = mono_usec();
+    ret = ble_ingest(&s, &ing);
+    elapsed = mono_usec() - start_us;
+
+    ble_source_close(&s);
+
+    if ( !elapsed ) elapsed = 1;
+
+    printf("Generated %lu reports of %u devices, %u addresses, ingested in %.3f s, %.0f reports/s\n",
+      (unsigned long)ing.pkts, truth.devices, truth.num, elapsed / 1000000.0, ing.pkts * 1000000.0 / elapsed);
+
+    if ( !ret ) ret = ble_truth_check(&truth);
+  }
+
+  ble_truth_free(&truth);
+
+return ret;
+}
+
+// Feed generated reports under retention policy and sample memory every
+// tenth of run. After warm up, when policy had time to drop anything,
+// memory should stay flat however many addresses devices went through.
+int ble_gen_retain( ble_gen_params_t *gp ) {
+
+  ble_source_t s;
+  ble_ingest_t ing;
+  ble_batch_t *batch;
+  size_t mem, base = 0, peak = 0;
+  uint64_t step_us, next_us = 0;
+  int num, i, sample = 0, ret = 0;
+
+  if ( ble_gen_source(&s, gp) < 0 )
+    return -1;
+
+  if ( (batch = malloc(sizeof(ble_batch_t))) == NULL ) {
+    perror("Could not allocate report batch");
+    exit(ENOMEM);
+  }
+
+  memset(&ing, 0, sizeof(ing));
+  step_us = gp->duration_s * 1000000ULL / BLE_GEN_RETAIN_SAMPLES;
+
+  ble_stream_free();
+
+  while ( (num = ble_source_next(&s, batch)) > 0 ) {
+
+    for ( i = 0 ; i < num ; i++ ) {
+
+      if ( ble_ingest_report(&ing, &batch->reps[i]) < 0 ) {
+        ret = -1;
+        goto ble_gen_retain_done;
+      }
+
+      if ( !next_us ) next_us = ing.first_us + step_us;
+      if ( ing.last_us < next_us ) continue;
+
+      mem = ble_stream_mem();
+
+      printf("%6.2f h: %lu reports, %lu KB, %lu expired streams\n",
+        (ing.last_us - ing.first_us) / 3600000000.0, (unsigned long)ing.pkts,
+        (unsigned long)(mem >> 10), (unsigned long)ble_retain_expired);
+
+      if ( ++sample == BLE_GEN_RETAIN_WARMUP ) base = mem;
+      if ( sample > BLE_GEN_RETAIN_WARMUP && mem > peak ) peak = mem;
+
+      next_us += step_us;
+    }
+  }
+
+  if ( num < 0 ) ret = -1;
+
+ble_gen_retain_done:
+
+  free(batch);
+  ble_source_close(&s);
+
+  if ( ret ) return ret;
+
+  if ( !base ) {
+    fprintf(stderr, "Run too short to sample memory\n");
+    return -1;
+  }
+
+  if ( peak > base + base / 4 ) {
+    fprintf(stderr, "Memory grows: %lu KB after warm up, %lu KB at peak\n",
+      (unsigned long)(base >> 10), (unsigned long)(peak >> 10));
+    return -1;
+  }
+
+  printf("Memory stays bounded: %lu KB after warm up, %lu KB at peak\n",
+    (unsigned long)(base >> 10), (unsigned long)(peak >> 10));
+
+return 0;
+}
+
+void ble_truth_init( ble_truth_t *t ) {
+
+  memset(t, 0, sizeof(ble_truth_t));
+  t->map.key_len = sizeof(bdaddr_t);
+}
+
+void ble_truth_free( ble_truth_t *t ) {
+
+  free(t->addrs);
+  ble_idx_free(&t->map);
+  ble_truth_init(t);
+}
+
+// Load FILE.truth written by ble_gen(): address,device,epoch
+int ble_truth_load( ble_truth_t *t, char *filename ) {
+
+  char line[128], addr[18];
+  unsigned int device, epoch;
+  unsigned long lines = 0;
+  bdaddr_t bda;
+  FILE *f;
+
+  if ( !(f = fopen(filename, "r")) ) {
+    perror("Couldn't load file");
+    return -1;
+  }
+
+  while ( fgets(line, sizeof(line), f) ) {
+
+    lines++;
+
+    if ( sscanf(line, "%17[^,],%u,%u", addr, &device, &epoch) != 3 || str2ba(addr, &bda) < 0 ) {
+      fprintf(stderr, "Unknown line format at line %lu!\n", lines);
+      fclose(f);
+      return -1;
+    }
+
+    ble_truth_add(t, &bda, device, epoch);
+  }
+
+  fclose(f);
+
+return 0;
+}
+
+// Track streams and compare them with ground truth. Every address change
+// inside stream is a link, it's right if both addresses belong to the same
+// device. Recall is share of address changes of all devices that were linked.
+int ble_truth_check( ble_truth_t *t ) {
+
+  ble_pkt_stream_t *bps;
+  ble_truth_addr_t *a, *prev;
+  uint32_t *seen, last;
+  uint64_t start_us, elapsed, streams = 0, mixed = 0, links = 0, right = 0, changes = 0, devices = 0, addrs = 0;
+  uintptr_t idx;
+  int merges, mix;
+
+  if ( !ble_stream ) {
+    fprintf(stderr, "No data to track\n");
+    return -1;
+  }
+
+  start_us = mono_usec();
+  merges = ble_stream_track(0);
+  elapsed = mono_usec() - start_us;
+
+  for ( uint32_t i = 0 ; i < t->num ; i++ )
+    t->addrs[i].seen = 0;
+
+  for ( bps = ble_stream ; bps ; bps = bps->next ) {
+
+    if ( !bps->cols.num ) continue;
+
+    streams++;
+    prev = NULL;
+    last = UINT32_MAX;
+    mix = 0;
+
+    for ( uint32_t i = 0 ; i < bps->cols.num ; i++ ) {
+
+      if ( bps->cols.bda[i] == last ) continue;
+      last = bps->cols.bda[i];
+
+      // addresses not generated are left out
+      if ( !(idx = (uintptr_t)ble_idx_get(&t->map, ble_addr_get(last))) ) continue;
+
+      a = &t->addrs[idx - 1];
+      a->seen = 1;
+
+      if ( prev && prev != a ) {
+        links++;
+        if ( prev->device == a->device ) right++;
+        else mix = 1;
+      }
+
+      prev = a;
+    }
+
+    mixed += mix;
+  }
+
+  if ( (seen = calloc(t->devices ? t->devices : 1, sizeof(uint32_t))) == NULL ) {
+    perror("Could not allocate tracking score");
+    exit(ENOMEM);
+  }
+
+  for ( uint32_t i = 0 ; i < t->num ; i++ ) {
+    if ( !t->addrs[i].seen ) continue;
+    seen[t->addrs[i].device]++;
+    addrs++;
+  }
+
+  for ( uint32_t d = 0 ; d < t->devices ; d++ ) {
+    if ( !seen[d] ) continue;
+    devices++;
+    changes += seen[d] - 1;
+  }
+
+  free(seen);
+
+  printf("Tracked in %.3f s, %d merges\n", elapsed / 1000000.0, merges);
+  printf("Ground truth: %lu devices, %lu addresses seen, %lu address changes\n",
+    (unsigned long)devices, (unsigned long)addrs, (unsigned long)changes);
+  printf("Streams: %lu, %lu of them mix devices\n", (unsigned long)streams, (unsigned long)mixed);
+  printf("Links: %lu right, %lu wrong, precision %.2f%%, recall %.2f%%\n",
+    (unsigned long)right, (unsigned long)(links - right),
+    links ? right * 100.0 / links : 100.0, changes ? right * 100.0 / changes : 100.0);
+
+return 0;
+}
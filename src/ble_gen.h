@@ -0,0 +1,87 @@
+/*
+ *
+ * Adrian Brzezinski (2020) <adrian.brzezinski at adrb.pl>
+ * License: GPLv2+
+ *
+ */
+
+#ifndef __BLE_GEN_H__
+#define __BLE_GEN_H__
+
+#include <stdint.h>
+#include <bluetooth/bluetooth.h>
+
+#include "ble_idx.h"
+#include "ble_source.h"
+
+// Synthetic EN traffic of simulated devices. Every device advertises at
+// its interval plus random delay, changes address every rotation period
+// and RPI/AEM together with it or a bit later, RSSI drifts and packets
+// get lost. Same seed gives the same reports.
+#define BLE_GEN_SEED 1
+#define BLE_GEN_DEVICES 1000
+#define BLE_GEN_DURATION_S 3600
+#define BLE_GEN_INTERVAL_MS 250
+#define BLE_GEN_JITTER_MS 10
+#define BLE_GEN_ROTATE_S 900
+#define BLE_GEN_DRIFT 0.5         // dB per packet
+#define BLE_GEN_LOSS 0.1
+#define BLE_GEN_START_S 1600000000  // fixed, so runs can be compared
+
+#define BLE_GEN_RSSI_MIN -100
+#define BLE_GEN_RSSI_MAX -30
+
+#define BLE_GEN_RETAIN_SAMPLES 10   // memory samples of ble_gen_retain() run
+#define BLE_GEN_RETAIN_WARMUP 2     // sample taken as baseline
+
+// True owner of every generated address, lets tracking be scored
+typedef struct {
+
+  bdaddr_t bda;
+  uint32_t device;
+  uint32_t epoch;       // address changes of device before this address
+  uint8_t seen;         // address is in some stream
+
+} ble_truth_addr_t;
+
+typedef struct {
+
+  ble_truth_addr_t *addrs;
+  uint32_t num;
+  uint32_t size;
+  uint32_t devices;
+
+  ble_idx_t map;        // address -> index + 1
+
+} ble_truth_t;
+
+typedef struct {
+
+  uint64_t seed;
+  uint32_t devices;
+  uint64_t reports;       // stop after that many reports, 0 is no limit
+  uint32_t duration_s;    // simulated time, 0 is no limit
+  uint32_t interval_ms;
+  uint32_t jitter_ms;     // random delay added to every interval
+  uint32_t rotate_s;      // address change period
+  uint32_t lag_ms;        // RPI and AEM change that long after address
+  uint32_t stay_s;        // time device is around, 0 is whole run
+  double drift;           // max RSSI change between packets, dB
+  double loss;            // share of lost packets
+  uint64_t start_us;      // time of first report, now if 0
+
+  ble_truth_t *truth;     // filled with generated addresses if set
+
+} ble_gen_params_t;
+
+void ble_gen_defaults( ble_gen_params_t *gp );
+int ble_gen_source( ble_source_t *s, ble_gen_params_t *gp );
+int ble_gen( ble_gen_params_t *gp, char *filename );
+int ble_gen_retain( ble_gen_params_t *gp );   // returns -1 if memory isn't bounded
+
+void ble_truth_init( ble_truth_t *t );
+void ble_truth_free( ble_truth_t *t );
+int ble_truth_load( ble_truth_t *t, char *filename );
+int ble_truth_check( ble_truth_t *t );
+
+#endif // __BLE_GEN_H__
@@ -5,15 +5,188 @@
  *
  */
 
+#include <poll.h>
+
 #include "bentool.h"
 
-// abort current operation in case of ctrl-c
-int abort_signal = 0;
-void set_abort_signal( int sig ) {
+ble_scan_params_t ble_scan_params = {
+  .type = 0,
+  .interval = 0x0010,
+  .window = 0x0010,
+  .own_type = LE_RANDOM_ADDRESS,
+  .filter = 0,
+  .filter_dup = 0,
+  .ext = 1,
+};
+
+// ctrl-c ends current operation
+static void ble_loop_sigint( ble_loop_t *loop, int fd, void *arg ) {
+  ble_loop_stop(loop);
+}
+
+// Command on user channel, nobody else reads the socket, so command
+// complete or status event is waited for here. Other events are dropped.
+static int xhci_user_req( int dd, struct hci_request *rq, int to ) {
+
+  unsigned char buf[HCI_MAX_EVENT_SIZE], *ptr;
+  uint16_t opcode = htobs(cmd_opcode_pack(rq->ogf, rq->ocf));
+  struct pollfd pfd = { .fd = dd, .events = POLLIN };
+  uint64_t deadline = mono_usec() + to * 1000ULL, now;
+  hci_event_hdr *hdr;
+  int len;
+
+  buf[0] = HCI_COMMAND_PKT;
+  memcpy(buf + 1, &opcode, 2);
+  buf[3] = rq->clen;
+  memcpy(buf + 4, rq->cparam, rq->clen);
+
+  while ( write(dd, buf, 4 + rq->clen) < 0 )
+    if ( errno != EINTR && errno != EAGAIN ) return -1;
+
+  while ( (now = mono_usec()) < deadline ) {
+
+    if ( poll(&pfd, 1, (deadline - now + 999) / 1000) <= 0 ) continue;
+
+    if ( (len = read(dd, buf, sizeof(buf))) < 0 ) {
+      if ( errno == EINTR || errno == EAGAIN ) continue;
+      return -1;
+    }
+
+    if ( len < 1 + HCI_EVENT_HDR_SIZE || buf[0] != HCI_EVENT_PKT ) continue;
+
+    hdr = (void*)(buf + 1);
+    ptr = buf + 1 + HCI_EVENT_HDR_SIZE;
+    len -= 1 + HCI_EVENT_HDR_SIZE;
+
+    if ( hdr->evt == EVT_CMD_STATUS && len >= EVT_CMD_STATUS_SIZE ) {
+
+      evt_cmd_status *cs = (void*)ptr;
+      if ( cs->opcode != opcode ) continue;
+
+      if ( cs->status ) {
+        errno = EIO;
+        return -1;
+      }
+
+      if ( rq->rlen ) memset(rq->rparam, 0, rq->rlen);
+      return 0;
+    }
+
+    if ( hdr->evt == EVT_CMD_COMPLETE && len >= EVT_CMD_COMPLETE_SIZE ) {
+
+      evt_cmd_complete *cc = (void*)ptr;
+      if ( cc->opcode != opcode ) continue;
+
+      ptr += EVT_CMD_COMPLETE_SIZE;
+      len -= EVT_CMD_COMPLETE_SIZE;
+
+      if ( len > rq->rlen ) len = rq->rlen;
+      memcpy(rq->rparam, ptr, len);
+      rq->rlen = len;
+
+      return 0;
+    }
+  }
+
+  errno = ETIMEDOUT;
+
+return -1;
+}
+
+// Same as hci_send_req(), works on user channel as well
+int xhci_send_req( int dd, int user, struct hci_request *rq, int to ) {
+
+  if ( !user ) return hci_send_req(dd, rq, to);
+
+return xhci_user_req(dd, rq, to);
+}
+
+static int xhci_user_cmd( int dd, uint16_t ogf, uint16_t ocf, void *cp, int clen ) {
+
+  struct hci_request rq;
+  uint8_t status = 0;
+
+  memset(&rq, 0, sizeof(rq));
+  rq.ogf = ogf;
+  rq.ocf = ocf;
+  rq.cparam = cp;
+  rq.clen = clen;
+  rq.rparam = &status;
+  rq.rlen = 1;
+
+  if ( xhci_user_req(dd, &rq, HCI_REQ_TIMEOUT) < 0 )
+    return -1;
+
+  if ( status ) {
+    errno = EIO;
+    return -1;
+  }
+
+return 0;
+}
+
+// Adapter is taken down and bound to user channel, kernel doesn't touch
+// it until it's closed. Controller is reset and LE events are enabled.
+static int xhci_open_user( int dev_id ) {
+
+  struct sockaddr_hci addr;
+  uint8_t mask[8];
+  int ctl, dd;
+
+  if ( (ctl = socket(AF_BLUETOOTH, SOCK_RAW | SOCK_CLOEXEC, BTPROTO_HCI)) < 0 ) {
+    perror("Could not open HCI control socket");
+    return -1;
+  }
+
+  if ( ioctl(ctl, HCIDEVDOWN, dev_id) < 0 && errno != EALREADY ) {
+    perror("Could not take device down");
+    close(ctl);
+    return -1;
+  }
+
+  close(ctl);
+
+  if ( (dd = socket(AF_BLUETOOTH, SOCK_RAW | SOCK_CLOEXEC, BTPROTO_HCI)) < 0 ) {
+    perror("Could not open device");
+    goto fail;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.hci_family = AF_BLUETOOTH;
+  addr.hci_dev = dev_id;
+  addr.hci_channel = HCI_CHANNEL_USER;
+
+  if ( bind(dd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ) {
+    perror("Could not open HCI user channel");
+    close(dd);
+    goto fail;
+  }
+
+  if ( xhci_user_cmd(dd, OGF_HOST_CTL, OCF_RESET, NULL, 0) < 0 ) {
+    perror("Controller reset failed");
+    goto fail_close;
+  }
+
+  for ( int i = 0 ; i < 8 ; i++ ) mask[i] = HCI_USER_EVENT_MASK >> (i * 8);
+  if ( xhci_user_cmd(dd, OGF_HOST_CTL, OCF_SET_EVENT_MASK, mask, sizeof(mask)) < 0 ) {
+    perror("Could not set event mask");
+    goto fail_close;
+  }
 
-  if ( sig != SIGINT ) return;
+  for ( int i = 0 ; i < 8 ; i++ ) mask[i] = HCI_USER_LE_EVENT_MASK >> (i * 8);
+  if ( xhci_user_cmd(dd, OGF_LE_CTL, OCF_LE_SET_EVENT_MASK, mask, sizeof(mask)) < 0 ) {
+    perror("Could not set LE event mask");
+    goto fail_close;
+  }
 
-  abort_signal = 1;
+return dd;
+
+fail_close:
+  close(dd);
+fail:
+  xhci_close_dev(&(btdev_t){ .dev_id = dev_id, .user = 1 }, -1);
+
+return -1;
 }
 
 int xhci_open_dev( btdev_t *btdev ) {
@@ -27,6 +200,9 @@ int xhci_open_dev( btdev_t *btdev ) {
     hci_devba(btdev->dev_id, &btdev->bda);
   }
 
+  if ( btdev->user )
+    return xhci_open_user(btdev->dev_id);
+
   dd = hci_open_dev(btdev->dev_id);
   if (dd < 0) {
     perror("Could not open device");
@@ -38,6 +214,29 @@ int xhci_open_dev( btdev_t *btdev ) {
 return dd;
 }
 
+// User channel is released and device is given back to kernel
+void xhci_close_dev( btdev_t *btdev, int dd ) {
+
+  int ctl;
+
+  if ( !btdev->user ) {
+    hci_close_dev(dd);
+    return;
+  }
+
+  if ( dd >= 0 ) close(dd);
+
+  if ( (ctl = socket(AF_BLUETOOTH, SOCK_RAW | SOCK_CLOEXEC, BTPROTO_HCI)) < 0 ) {
+    perror("Could not open HCI control socket");
+    return;
+  }
+
+  if ( ioctl(ctl, HCIDEVUP, btdev->dev_id) < 0 && errno != EALREADY )
+    perror("Could not bring device back up");
+
+  close(ctl);
+}
+
 int xhci_dev_info(int s, int dev_id, long arg) {
 
   struct hci_dev_info di = { .dev_id = dev_id };
@@ -66,15 +265,552 @@ void print_dev_info( btdev_t *btdev ) {
   printf("\n");
 }
 
-int ble_scan_events( int dd ) {
+// Kernel receive time of event, it's the same for every report in it.
+// Falls back to current time when socket doesn't deliver timestamps.
+static uint64_t ble_scan_tstamp( struct msghdr *msg ) {
 
-  unsigned char buf[HCI_MAX_EVENT_SIZE], *ptr;
-  struct hci_filter nf, of;
+  struct cmsghdr *cmsg;
+  struct timeval tv;
+
+  for ( cmsg = CMSG_FIRSTHDR(msg) ; cmsg ; cmsg = CMSG_NXTHDR(msg, cmsg) ) {
+
+    // user channel delivers socket timestamp
+    if ( (cmsg->cmsg_level == SOL_HCI && cmsg->cmsg_type == HCI_CMSG_TSTAMP) ||
+         (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMP) ) {
+      memcpy(&tv, CMSG_DATA(cmsg), sizeof(tv));
+      return tvusec(&tv);
+    }
+  }
+
+  gettimeofday(&tv, NULL);
+
+return tvusec(&tv);
+}
+
+// HCI socket is readable, take every pending event into ring at once
+static void ble_scan_read( ble_loop_t *loop, int fd, void *arg ) {
+
+  ble_scan_src_t *src = arg;
+  unsigned char scratch[HCI_MAX_EVENT_SIZE];
+  char control[CMSG_SPACE(sizeof(struct timeval))];
+  ble_ring_slot_t *slot;
+  struct iovec iov = { .iov_len = HCI_MAX_EVENT_SIZE };
+  struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+  int len, batch;
+
+  for ( batch = 0 ;; ) {
+
+    // event is read into ring slot, or thrown away when ring is full
+    slot = ble_ring_reserve(&src->ring);
+
+    iov.iov_base = slot ? slot->data : scratch;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    if ( (len = recvmsg(fd, &msg, MSG_DONTWAIT)) < 0 ) {
+
+      if ( errno == EINTR ) continue;
+      if ( errno != EAGAIN && errno != EWOULDBLOCK ) src->error = errno;
+
+      break;
+    }
+
+    if ( !slot ) {
+      ble_ring_drop(&src->ring);
+      continue;
+    }
+
+    slot->recv_us = ble_scan_tstamp(&msg);
+    slot->len = len;
+    slot->src = src - src->scan->src;
+
+    ble_ring_commit(&src->ring);
+    batch++;
+  }
+
+  if ( batch ) ble_ring_notify(&src->ring);
+
+  if ( src->error ) {
+    ble_loop_stop(loop);
+    ble_loop_stop(&src->scan->ctl);
+  }
+}
+
+// Capture thread of one adapter, runs until main thread or read error stops its loop
+static void* ble_scan_capture( void *arg ) {
+
+  ble_scan_src_t *src = arg;
+
+  if ( ble_loop_run(&src->loop) < 0 ) {
+    src->error = errno;
+    ble_loop_stop(&src->scan->ctl);
+  }
+
+  atomic_store(&src->stop, 1);
+  ble_ring_notify(&src->ring);
+
+return NULL;
+}
+
+// Legacy advertising report event with single report, like controller sends
+static void ble_scan_replay_event( ble_ring_slot_t *slot, ble_report_t *rep ) {
+
+  hci_event_hdr *hdr = (hci_event_hdr*)(slot->data + 1);
+  evt_le_meta_event *meta = (evt_le_meta_event*)(hdr + 1);
+  le_advertising_info *info = (le_advertising_info*)(meta->data + 1);
+  uint8_t len = rep->info->length;
+
+  if ( len > BLE_SCAN_REPLAY_DATA_MAX ) len = BLE_SCAN_REPLAY_DATA_MAX;
+
+  slot->data[0] = HCI_EVENT_PKT;
+  hdr->evt = EVT_LE_META_EVENT;
+  hdr->plen = 2 + sizeof(le_advertising_info) + len + 1;
+  meta->subevent = EVT_LE_ADVERTISING_REPORT;
+  meta->data[0] = 1;
+
+  memcpy(info, rep->info, sizeof(le_advertising_info) + len);
+  info->length = len;
+  info->data[len] = rep->info->data[rep->info->length];
+
+  slot->len = 1 + HCI_EVENT_HDR_SIZE + hdr->plen;
+  slot->recv_us = rep->recv_us;
+  slot->src = rep->src < BLE_SCAN_SRC_MAX ? rep->src : 0;
+}
+
+// Short sleeps, so replay thread notices stop soon
+static void ble_scan_replay_sleep( uint64_t ns ) {
+
+  struct timespec ts;
+
+  if ( ns > BLE_SCAN_REPLAY_SLEEP_NS ) ns = BLE_SCAN_REPLAY_SLEEP_NS;
+
+  ts.tv_sec = 0;
+  ts.tv_nsec = ns;
+  nanosleep(&ts, NULL);
+}
+
+// Replay thread, takes place of capture thread. Reports are pushed into
+// ring as HCI events, paced by recorded receive times scaled by speed, or
+// as fast as ingest takes them. Nothing is dropped, full ring is waited for.
+static void* ble_scan_replay( void *arg ) {
+
+  ble_scan_src_t *src = arg;
+  ble_batch_t *batch;
+  ble_ring_slot_t *slot;
+  ble_report_t *rep;
+  uint64_t start_ns = 0, first_us = 0, due_ns, now_ns;
+  int i = 0, num = 0, pending = 0;
+
+  if ( (batch = malloc(sizeof(ble_batch_t))) == NULL ) {
+    perror("Could not allocate report batch");
+    exit(ENOMEM);
+  }
+
+  while ( !ble_loop_stopped(&src->loop) ) {
+
+    if ( i == num ) {
+
+      if ( (num = ble_source_next(src->replay, batch)) <= 0 ) {
+        if ( num < 0 ) src->error = EIO;
+        break;
+      }
+
+      i = 0;
+    }
+
+    rep = &batch->reps[i];
+
+    if ( src->speed > 0 ) {
+
+      if ( !start_ns ) {
+        start_ns = mono_nsec();
+        first_us = rep->recv_us;
+      }
+
+      due_ns = start_ns;
+      if ( rep->recv_us > first_us )
+        due_ns += (rep->recv_us - first_us) * 1000.0 / src->speed;
+
+      if ( due_ns > (now_ns = mono_nsec()) ) {
+
+        if ( pending ) {
+          ble_ring_notify(&src->ring);
+          pending = 0;
+        }
+
+        ble_scan_replay_sleep(due_ns - now_ns);
+        continue;
+      }
+    }
+
+    // ingest is behind
+    if ( (slot = ble_ring_reserve(&src->ring)) == NULL ) {
+      ble_ring_notify(&src->ring);
+      pending = 0;
+      ble_scan_replay_sleep(BLE_SCAN_REPLAY_FULL_NS);
+      continue;
+    }
+
+    ble_scan_replay_event(slot, rep);
+    slot->queued_ns = mono_nsec();
+
+    ble_ring_commit(&src->ring);
+    i++;
+
+    if ( ++pending == BLE_SCAN_REPLAY_NOTIFY ) {
+      ble_ring_notify(&src->ring);
+      pending = 0;
+    }
+  }
+
+  free(batch);
+
+  atomic_store(&src->stop, 1);
+  ble_ring_notify(&src->ring);
+
+  // scan ends when ingest drains the ring
+  ble_loop_stop(&src->scan->ctl);
+
+return NULL;
+}
+
+// Advertising report goes to batch, info is followed by RSSI byte
+static int ble_scan_report( ble_scan_src_t *src, ble_batch_t *batch, ble_ring_slot_t *slot,
+    le_advertising_info *info, uint64_t recv_us ) {
+
+  if ( !ble_batch_adv(batch, recv_us, slot->src, info, info->data[info->length]) )
+    return BLE_SCAN_EVENT_FULL;
+
+  atomic_fetch_add_explicit(&src->reports, 1, memory_order_relaxed);
+
+return 0;
+}
+
+static int ble_scan_adv_reports( ble_scan_src_t *src, ble_batch_t *batch, ble_ring_slot_t *slot,
+    uint8_t *data, unsigned char *end ) {
+
+  uint8_t reports_num = data[0];
+  le_advertising_info *info = (le_advertising_info *) (data + 1);
+  for ( uint32_t i = 0 ; i < reports_num ; i++ ) {
+
+    // report with RSSI byte has to fit in event
+    if ( (unsigned char*)info + sizeof(le_advertising_info) > end ||
+         info->data + info->length + 1 > end )
+      break;
+
+    if ( i >= src->taken ) {
+      if ( ble_scan_report(src, batch, slot, info, slot->recv_us) )
+        return BLE_SCAN_EVENT_FULL;
+      src->taken = i + 1;
+    }
+
+    info = (le_advertising_info *) (info->data + info->length + 1);
+  }
+
+return 0;
+}
+
+// Legacy PDUs reported as extended get their legacy event type back
+static uint8_t ble_scan_ext_type( uint16_t evt_type ) {
+
+  if ( !(evt_type & BLE_EXT_EVT_LEGACY) )
+    return BLE_EXT_EVT_TYPE | (evt_type & 0x0f);
+
+  switch ( evt_type & 0x1f ) {
+    case 0x13: return 0x00;   // ADV_IND
+    case 0x15: return 0x01;   // ADV_DIRECT_IND
+    case 0x12: return 0x02;   // ADV_SCAN_IND
+    case 0x10: return 0x03;   // ADV_NONCONN_IND
+  }
+
+return 0x04;  // SCAN_RSP
+}
+
+// Fragment buffer of advertiser, oldest incomplete one is reused when all are taken
+static ble_scan_frag_t* ble_scan_frag( ble_scan_src_t *src, ble_ext_adv_info *ext, uint64_t recv_us ) {
+
+  ble_scan_frag_t *frag, *reuse = NULL;
+  le_advertising_info *info;
+
+  for ( int i = 0 ; i < BLE_SCAN_FRAGS ; i++ ) {
+
+    frag = &src->frags[i];
+    info = (le_advertising_info*)frag->buf;
+
+    if ( frag->used && frag->sid == ext->sid && info->bdaddr_type == ext->bdaddr_type &&
+         !bacmp(&info->bdaddr, &ext->bdaddr) )
+      return frag;
+
+    if ( !reuse || (reuse->used && (!frag->used || frag->recv_us < reuse->recv_us)) )
+      reuse = frag;
+  }
+
+  frag = reuse;
+  info = (le_advertising_info*)frag->buf;
+
+  frag->used = 1;
+  frag->sid = ext->sid;
+  frag->recv_us = recv_us;
+
+  info->evt_type = ble_scan_ext_type(btohs(ext->evt_type));
+  info->bdaddr_type = ext->bdaddr_type;
+  bacpy(&info->bdaddr, &ext->bdaddr);
+  info->length = 0;
+  info->data[0] = ext->rssi;
+
+return frag;
+}
+
+// Extended reports, data of one advertisement can be split across
+// several reports and events. RSSI and time of first fragment are kept.
+static int ble_scan_ext_reports( ble_scan_src_t *src, ble_batch_t *batch, ble_ring_slot_t *slot,
+    uint8_t *data, unsigned char *end ) {
+
+  ble_scan_frag_t *frag;
+  le_advertising_info *info;
+  int8_t rssi;
+  size_t len;
+
+  uint8_t reports_num = data[0];
+  ble_ext_adv_info *ext = (ble_ext_adv_info *) (data + 1);
+  for ( uint32_t i = 0 ; i < reports_num ; i++, ext = (ble_ext_adv_info *) (ext->data + ext->length) ) {
+
+    if ( (unsigned char*)ext + sizeof(ble_ext_adv_info) > end ||
+         ext->data + ext->length > end )
+      break;
+
+    // fragments of reports taken before are already appended
+    if ( i < src->taken ) continue;
+
+    // room is checked first, fragment can't be appended twice
+    if ( BLE_EXT_EVT_STATUS(btohs(ext->evt_type)) != BLE_EXT_EVT_MORE &&
+         !ble_batch_room(batch, 1, sizeof(le_advertising_info) + BLE_SCAN_FRAG_MAX + 1) )
+      return BLE_SCAN_EVENT_FULL;
+
+    frag = ble_scan_frag(src, ext, slot->recv_us);
+    info = (le_advertising_info*)frag->buf;
+
+    rssi = info->data[info->length];
+
+    len = ext->length;
+    if ( info->length + len > BLE_SCAN_FRAG_MAX ) len = BLE_SCAN_FRAG_MAX - info->length;
+
+    memcpy(info->data + info->length, ext->data, len);
+    info->length += len;
+    info->data[info->length] = rssi;
+
+    if ( BLE_EXT_EVT_STATUS(btohs(ext->evt_type)) != BLE_EXT_EVT_MORE ) {
+
+      frag->used = 0;
+      ble_scan_report(src, batch, slot, info, frag->recv_us);
+    }
+
+    src->taken = i + 1;
+  }
+
+return 0;
+}
+
+// Event of source's ring, reports are tagged with adapter of slot
+static int ble_scan_event( ble_scan_src_t *src, ble_batch_t *batch, ble_ring_slot_t *slot ) {
+
+  unsigned char *ptr, *end;
+
+  if ( slot->len < 1 + HCI_EVENT_HDR_SIZE + 2 ) {
+    fprintf(stderr, "HCI event partial read");
+    return 0;
+  }
+
+  // user channel isn't filtered
+  if ( slot->data[0] != HCI_EVENT_PKT || slot->data[1] != EVT_LE_META_EVENT )
+    return 0;
+
+  ptr = slot->data + (1 + HCI_EVENT_HDR_SIZE);
+  end = slot->data + slot->len;
+
+  evt_le_meta_event *meta = (void *) ptr;
+
+  switch ( meta->subevent ) {
+    case EVT_LE_ADVERTISING_REPORT:
+      return ble_scan_adv_reports(src, batch, slot, meta->data, end);
+    case EVT_LE_EXT_ADVERTISING_REPORT:
+      return ble_scan_ext_reports(src, batch, slot, meta->data, end);
+  }
+
+return 0;
+}
+
+static uint64_t ble_scan_now() {
+
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+
+return tvusec(&tv);
+}
+
+// Capture source of all adapters, turns events into reports. Oldest event
+// of all rings goes first. While some adapter has nothing queued, event
+// waits up to BLE_SCAN_MERGE_US for it, so packets from different adapters
+// are added to streams in receive time order. Ends when capture threads
+// are done and rings are drained.
+static int ble_scan_source_next( ble_source_t *s, ble_batch_t *batch ) {
+
+  ble_scan_t *scan = s->priv;
+  ble_ring_t *rings[BLE_SCAN_SRC_MAX];
+  ble_ring_slot_t *slot, *oldest;
+  uint64_t now_us, wait_us, t0 = 0;
+  int i, best = 0, ready, running, stopped;
+
+  for ( i = 0 ; i < scan->src_num ; i++ )
+    rings[i] = &scan->src[i].ring;
+
+  while ( ble_batch_room(batch, BLE_SCAN_EVENT_REPORTS, BLE_SCAN_EVENT_BYTES) ) {
+
+    oldest = NULL;
+    ready = 1;
+    running = 0;
+
+    for ( i = 0 ; i < scan->src_num ; i++ ) {
+
+      // stop flag goes first, so events committed before it are seen
+      stopped = atomic_load(&scan->src[i].stop);
+
+      if ( (slot = ble_ring_peek(rings[i])) ) {
+        if ( !oldest || slot->recv_us < oldest->recv_us ) {
+          oldest = slot;
+          best = i;
+        }
+      } else if ( !stopped ) {
+        ready = 0;
+      }
+
+      running += !stopped;
+    }
+
+    wait_us = 0;
+
+    if ( oldest && !ready ) {
+      now_us = ble_scan_now();
+      if ( oldest->recv_us + BLE_SCAN_MERGE_US > now_us )
+        wait_us = oldest->recv_us + BLE_SCAN_MERGE_US - now_us;
+    }
+
+    if ( oldest && !wait_us ) {
+
+      if ( scan->stages ) {
+        t0 = mono_nsec();
+        if ( !scan->src[best].taken )
+          ble_stage_add(scan->stages, BLE_STAGE_QUEUE, t0 - oldest->queued_ns);
+      }
+
+      // full batch goes first, event is taken again with next one
+      if ( ble_scan_event(&scan->src[best], batch, oldest) == BLE_SCAN_EVENT_FULL )
+        break;
+
+      if ( scan->stages )
+        ble_stage_add(scan->stages, BLE_STAGE_PARSE, mono_nsec() - t0);
+
+      scan->src[best].taken = 0;
+      ble_ring_pop(rings[best]);
+      continue;
+    }
+
+    // collected reports go before waiting for more
+    if ( batch->num || (!oldest && !running) )
+      break;
+
+    ble_ring_wait(rings, scan->src_num, oldest ? (wait_us + 999) / 1000 : -1);
+  }
+
+return batch->num;
+}
+
+static const ble_source_ops_t ble_scan_source_ops = {
+  .name = "HCI",
+  .next = ble_scan_source_next,
+};
+
+// Ingest thread, reports of adapters go to streams, capture file and output
+static void* ble_scan_ingest( void *arg ) {
+
+  ble_scan_t *scan = arg;
+  ble_source_t s = { .ops = &ble_scan_source_ops, .priv = scan };
+  ble_ingest_t ing;
+
+  memset(&ing, 0, sizeof(ing));
+  ing.capw = scan->capw;
+  ing.out = &scan->out;
+  ing.stages = scan->stages;
+
+  if ( ble_ingest(&s, &ing) < 0 )
+    ble_loop_stop(&scan->ctl);
+
+return NULL;
+}
+
+// Periodic job of main thread
+static void ble_scan_tick( ble_loop_t *loop, int fd, void *arg ) {
+
+  ble_scan_t *scan = arg;
+  ble_scan_src_t *src;
+  uint64_t reports;
+
+  for ( int i = 0 ; i < scan->src_num ; i++ ) {
+
+    src = &scan->src[i];
+    reports = atomic_load_explicit(&src->reports, memory_order_relaxed);
+
+    src->rate = (reports - src->tick_reports) * 1000 / BLE_SCAN_TICK_MS;
+    if ( src->rate > src->peak_rate ) src->peak_rate = src->rate;
+    src->tick_reports = reports;
+  }
+
+  ble_cap_writer_flush(scan->capw);
+  ble_out_tick(&scan->out);
+}
+
+static void ble_scan_src_free( ble_scan_src_t *src ) {
+
+  int opt = 0;
+
+  if ( !src->user && !src->replay ) {
+    setsockopt(src->dd, SOL_HCI, HCI_TIME_STAMP, &opt, sizeof(opt));
+    setsockopt(src->dd, SOL_HCI, HCI_FILTER, &src->of, sizeof(src->of));
+  }
+
+  ble_loop_free(&src->loop);
+  ble_ring_free(&src->ring);
+}
+
+// Socket receives only LE meta events, stamped by kernel
+static int ble_scan_src_init( ble_scan_src_t *src ) {
+
+  struct hci_filter nf;
   socklen_t olen;
-  int len = -1;
+  int opt = 1;
+
+  // replay has no socket
+  if ( src->replay ) {
+
+    if ( ble_ring_init(&src->ring, BLE_RING_SLOTS) < 0 ||
+         ble_loop_init(&src->loop) < 0 ) {
+      ble_scan_src_free(src);
+      return -1;
+    }
+
+    goto done;
+  }
 
-  olen = sizeof(of);
-  if (getsockopt(dd, SOL_HCI, HCI_FILTER, &of, &olen) < 0) {
+  // user channel has no filters, only socket timestamps
+  if ( src->user ) {
+    if (setsockopt(src->dd, SOL_SOCKET, SO_TIMESTAMP, &opt, sizeof(opt)) < 0)
+      perror("Could not enable receive timestamps");
+    goto init;
+  }
+
+  olen = sizeof(src->of);
+  if (getsockopt(src->dd, SOL_HCI, HCI_FILTER, &src->of, &olen) < 0) {
     printf("Could not get socket options\n");
     return -1;
   }
@@ -83,137 +819,431 @@ int ble_scan_events( int dd ) {
   hci_filter_set_ptype(HCI_EVENT_PKT, &nf);
   hci_filter_set_event(EVT_LE_META_EVENT, &nf);
 
-  if (setsockopt(dd, SOL_HCI, HCI_FILTER, &nf, sizeof(nf)) < 0) {
+  if (setsockopt(src->dd, SOL_HCI, HCI_FILTER, &nf, sizeof(nf)) < 0) {
     printf("Could not set socket options\n");
     return -1;
   }
 
-  abort_signal = 0;
-  signal(SIGINT, &set_abort_signal);
+  // events are stamped by kernel when received from controller
+  if (setsockopt(src->dd, SOL_HCI, HCI_TIME_STAMP, &opt, sizeof(opt)) < 0)
+    perror("Could not enable receive timestamps");
 
-  while ( !abort_signal ) {
+init:
+  if ( ble_ring_init(&src->ring, BLE_RING_SLOTS) < 0 ||
+       ble_loop_init(&src->loop) < 0 ||
+       ble_loop_add(&src->loop, src->dd, ble_scan_read, src) < 0 ) {
+    ble_scan_src_free(src);
+    return -1;
+  }
 
-    while ((len = read(dd, buf, sizeof(buf))) < 0) {
+done:
+  atomic_init(&src->stop, 0);
+  atomic_init(&src->reports, 0);
 
-      if ( abort_signal ) goto done;
+return 0;
+}
 
-      if (errno == EAGAIN || errno == EINTR)
-        continue;
+static void ble_scan_src_stats( ble_scan_src_t *src ) {
+
+  if ( src->replay )
+    printf("replay");
+  else
+    printf("hci%d", src->dev_id);
+
+  printf(": %lu events, %lu reports, %lu dropped, peak %u reports/s, ring high water mark %u of %u slots\n",
+    (unsigned long)src->ring.pushed, (unsigned long)atomic_load(&src->reports),
+    (unsigned long)src->ring.dropped, src->peak_rate, src->ring.high_water, src->ring.mask + 1);
+}
 
+// Capture from every source until ctrl-c, sources have open sockets
+int ble_scan_events( ble_scan_t *scan ) {
+
+  ble_scan_src_t *src;
+  pthread_t ingest;
+  sigset_t oldmask;
+  int i, num, started, ret = 0;
+
+  scan->ctl.epfd = -1;
+
+  for ( num = 0 ; num < scan->src_num ; num++ ) {
+
+    src = &scan->src[num];
+    src->scan = scan;
+    src->loop.epfd = -1;
+
+    if ( ble_scan_src_init(src) < 0 ) {
+      ret = -1;
       goto done;
     }
+  }
 
-    if ( len < HCI_EVENT_HDR_SIZE ) {
-      fprintf(stderr, "HCI event partial read");
-      goto done;
+  // threads inherit blocked SIGINT, it's received by signalfd only
+  ble_loop_block(SIGINT, &oldmask);
+
+  if ( ble_loop_init(&scan->ctl) < 0 ||
+       ble_loop_signal(&scan->ctl, SIGINT, ble_loop_sigint, NULL) < 0 ||
+       ble_loop_timer(&scan->ctl, BLE_SCAN_TICK_MS, ble_scan_tick, scan) < 0 ||
+       ble_out_start(&scan->out, scan->out.mode) < 0 ) {
+    ret = -1;
+    goto unblock;
+  }
+
+  if ( (errno = pthread_create(&ingest, NULL, ble_scan_ingest, scan)) ) {
+    perror("Couldn't start ingest thread");
+    ble_out_stop(&scan->out);
+    ret = -1;
+    goto unblock;
+  }
+
+  for ( started = 0 ; started < num ; started++ ) {
+    if ( (errno = pthread_create(&scan->src[started].thread, NULL,
+           scan->src[started].replay ? ble_scan_replay : ble_scan_capture, &scan->src[started])) ) {
+      perror("Couldn't start capture thread");
+      ret = -1;
+      break;
     }
+  }
 
-    ptr = buf + (1 + HCI_EVENT_HDR_SIZE);
-    len -= (1 + HCI_EVENT_HDR_SIZE);
+  // sources without thread are done, so ingest doesn't wait for them
+  for ( i = started ; i < num ; i++ ) {
+    atomic_store(&scan->src[i].stop, 1);
+    ble_ring_notify(&scan->src[i].ring);
+  }
 
-    evt_le_meta_event *meta = (void *) ptr;
-    if (meta->subevent != EVT_LE_ADVERTISING_REPORT)
-      continue;
+  if ( !ret )
+    ble_loop_run(&scan->ctl);
 
-    uint8_t reports_num = meta->data[0];
-    le_advertising_info *info = (le_advertising_info *) (meta->data + 1);
-    while ( reports_num-- ) {
+  // capture threads wake up at once, ingest drains what's left in rings
+  for ( i = 0 ; i < started ; i++ )
+    ble_loop_stop(&scan->src[i].loop);
 
-      ble_pkt_t *new_pkt = ble_info2pkt(info);
-      if ( !new_pkt || ble_stream_pkt_add(new_pkt) < 0 ) {
-        abort_signal = 1;
-        break;
-      }
+  for ( i = 0 ; i < started ; i++ )
+    pthread_join(scan->src[i].thread, NULL);
 
-      if ( new_pkt->data_type == BLE_GA_EN ) {
-        ble_pkt_print(new_pkt, 0);
-        printf("\n");
-      }
+  pthread_join(ingest, NULL);
+
+  ble_out_stop(&scan->out);
 
-      info = (le_advertising_info *) (info->data + info->length + 1);
+  for ( i = 0 ; i < num ; i++ ) {
+
+    src = &scan->src[i];
+    ble_scan_src_stats(src);
+
+    if ( src->error && !ret ) {
+      errno = src->error;
+      ret = -1;
     }
   }
 
+unblock:
+  ble_loop_free(&scan->ctl);
+  ble_loop_unblock(SIGINT, &oldmask);
+
 done:
+  for ( i = 0 ; i < num ; i++ )
+    ble_scan_src_free(&scan->src[i]);
+
+return ret;
+}
+
+static int ble_scan_ext_supported( ble_scan_src_t *src ) {
+
+  le_read_local_supported_features_rp rp;
+  struct hci_request rq;
+
+  memset(&rq, 0, sizeof(rq));
+  rq.ogf = OGF_LE_CTL;
+  rq.ocf = OCF_LE_READ_LOCAL_SUPPORTED_FEATURES;
+  rq.rparam = &rp;
+  rq.rlen = LE_READ_LOCAL_SUPPORTED_FEATURES_RP_SIZE;
 
-  signal(SIGINT, SIG_DFL);
+  if ( xhci_send_req(src->dd, src->user, &rq, HCI_REQ_TIMEOUT) < 0 || rp.status )
+    return 0;
+
+return (rp.features[BLE_LE_FEAT_EXT_ADV / 8] >> (BLE_LE_FEAT_EXT_ADV % 8)) & 1;
+}
+
+static int ble_scan_cmd( ble_scan_src_t *src, uint16_t ocf, void *cp, int clen ) {
 
-  setsockopt(dd, SOL_HCI, HCI_FILTER, &of, sizeof(of));
+  struct hci_request rq;
+  uint8_t status;
 
-  if (len < 0 && !abort_signal )
+  memset(&rq, 0, sizeof(rq));
+  rq.ogf = OGF_LE_CTL;
+  rq.ocf = ocf;
+  rq.cparam = cp;
+  rq.clen = clen;
+  rq.rparam = &status;
+  rq.rlen = 1;
+
+  if ( xhci_send_req(src->dd, src->user, &rq, HCI_REQ_TIMEOUT) < 0 )
     return -1;
 
+  if ( status ) {
+    errno = EIO;
+    return -1;
+  }
+
 return 0;
 }
 
-int ble_scan( btdev_t *btdev ) {
+// Scanning on 1M PHY only, EN beacons are legacy advertisements
+static int ble_scan_ext_enable( ble_scan_src_t *src, ble_scan_params_t *sp, uint8_t enable ) {
 
-  int dd = -1;
+  ble_ext_scan_params_cp params;
+  ble_ext_scan_enable_cp cp;
 
-  if (!btdev) return 1;
+  if ( enable ) {
 
-  if ( (dd = xhci_open_dev(btdev)) < 0 )
+    memset(&params, 0, sizeof(params));
+    params.own_bdaddr_type = sp->own_type;
+    params.filter = sp->filter;
+    params.phys = BLE_SCAN_PHY_1M;
+    params.type = sp->type;
+    params.interval = htobs(sp->interval);
+    params.window = htobs(sp->window);
+
+    if ( ble_scan_cmd(src, OCF_LE_SET_EXT_SCAN_PARAMETERS, &params, sizeof(params)) < 0 )
+      return -1;
+  }
+
+  memset(&cp, 0, sizeof(cp));
+  cp.enable = enable;
+  cp.filter_dup = sp->filter_dup;
+
+return ble_scan_cmd(src, OCF_LE_SET_EXT_SCAN_ENABLE, &cp, sizeof(cp));
+}
+
+static int ble_scan_legacy_enable( ble_scan_src_t *src, ble_scan_params_t *sp, uint8_t enable ) {
+
+  le_set_scan_parameters_cp params;
+  le_set_scan_enable_cp cp;
+
+  if ( enable ) {
+
+    memset(&params, 0, sizeof(params));
+    params.type = sp->type;
+    params.interval = htobs(sp->interval);
+    params.window = htobs(sp->window);
+    params.own_bdaddr_type = sp->own_type;
+    params.filter = sp->filter;
+
+    if ( ble_scan_cmd(src, OCF_LE_SET_SCAN_PARAMETERS, &params, LE_SET_SCAN_PARAMETERS_CP_SIZE) < 0 )
+      return -1;
+  }
+
+  memset(&cp, 0, sizeof(cp));
+  cp.enable = enable;
+  cp.filter_dup = sp->filter_dup;
+
+return ble_scan_cmd(src, OCF_LE_SET_SCAN_ENABLE, &cp, LE_SET_SCAN_ENABLE_CP_SIZE);
+}
+
+static int ble_scan_enable( ble_scan_src_t *src, btdev_t *btdev ) {
+
+  ble_scan_params_t *sp = &ble_scan_params;
+
+  if ( (src->dd = xhci_open_dev(btdev)) < 0 )
     return -1;
 
-  /*
-   * int hci_le_set_scan_parameters(int dev_id, uint8_t type, uint16_t interval,
-   *       uint16_t window, uint8_t own_type, uint8_t filter, int to);
-   *
-   * type:
-   *   0 - passive
-   *   1 - active
-   * own_type:
-   *   LE_PUBLIC_ADDRESS - Public Device Address
-   *   LE_RANDOM_ADDRESS
-   * filter:
-   *   0 - accept all
-   *   1 - whitelist
-   * to:
-   *   int - hci request timeout in ms
-   */
-  if ( hci_le_set_scan_parameters(dd, 0, htobs(0x0010), htobs(0x0010),
-        LE_RANDOM_ADDRESS, 0, HCI_REQ_TIMEOUT) < 0 ) {
-    perror("Set scan parameters failed");
-    return 0;
+  src->dev_id = btdev->dev_id;
+  src->user = btdev->user;
+
+  // Bluetooth 5 controllers, legacy commands are used if that fails
+  if ( sp->ext && ble_scan_ext_supported(src) ) {
+
+    if ( ble_scan_ext_enable(src, sp, 0x01) == 0 ) {
+      src->ext = 1;
+      return 0;
+    }
+
+    fprintf(stderr, "hci%d: extended scan failed, using legacy scan\n", src->dev_id);
   }
 
-  /*
-   * int hci_le_set_scan_enable(int dev_id, uint8_t enable, uint8_t filter_dup, int to);
-   */
-  if ( hci_le_set_scan_enable(dd, 0x01, 0, HCI_REQ_TIMEOUT) < 0 ) {
+  if ( ble_scan_legacy_enable(src, sp, 0x01) < 0 ) {
     perror("Enable scan failed");
-    return 1;
+    xhci_close_dev(btdev, src->dd);
+    return -1;
+  }
+
+return 0;
+}
+
+static int ble_scan_disable( ble_scan_src_t *src ) {
+
+  btdev_t dev = { .dev_id = src->dev_id, .user = src->user };
+  int ret = 0;
+
+  if ( (src->ext ? ble_scan_ext_enable(src, &ble_scan_params, 0x00) :
+        ble_scan_legacy_enable(src, &ble_scan_params, 0x00)) < 0 ) {
+    fprintf(stderr, "hci%d: ", src->dev_id);
+    perror("Disable scan failed");
+    ret = -1;
+  }
+
+  xhci_close_dev(&dev, src->dd);
+
+return ret;
+}
+
+// Throughput of whole scan and CPU time it took, all threads included
+static void ble_scan_usage( ble_scan_t *scan, const char *what, uint64_t start_us, struct rusage *ru0 ) {
+
+  struct rusage ru;
+  uint64_t reports = 0;
+  double secs, user, sys;
+
+  getrusage(RUSAGE_SELF, &ru);
+
+  secs = (mono_usec() - start_us) / 1000000.0;
+  user = (tvusec(&ru.ru_utime) - tvusec(&ru0->ru_utime)) / 1000000.0;
+  sys = (tvusec(&ru.ru_stime) - tvusec(&ru0->ru_stime)) / 1000000.0;
+
+  for ( int i = 0 ; i < scan->src_num ; i++ )
+    reports += atomic_load(&scan->src[i].reports);
+
+  if ( secs <= 0 ) return;
+
+  printf("%s for %.1lfs, %.1lf reports/s, CPU %.1lf%% (user %.2lfs, system %.2lfs)\n",
+    what, secs, reports / secs, (user + sys) * 100.0 / secs, user, sys);
+}
+
+int ble_scan( btdev_t *btdev, ble_scan_opts_t *opts ) {
+
+  ble_scan_t *scan;
+  btdev_t dev;
+  struct rusage ru0;
+  uint64_t start_us;
+  int i, ret = 0;
+
+  if (!btdev) return 1;
+
+  if ( (scan = calloc(1, sizeof(ble_scan_t))) == NULL ) {
+    perror("Could not allocate scan");
+    exit(ENOMEM);
+  }
+
+  scan->out.mode = opts->output;
+
+  // selected device, or every adapter from the list
+  for ( i = 0 ; i < (opts->dev_num ? opts->dev_num : 1) ; i++ ) {
+
+    if ( opts->dev_num ) {
+      memset(&dev, 0, sizeof(dev));
+      dev.dev_id = opts->dev_ids[i];
+      dev.user = btdev->user;
+    }
+
+    if ( ble_scan_enable(&scan->src[i], opts->dev_num ? &dev : btdev) < 0 ) {
+      ret = 1;
+      goto done;
+    }
+
+    scan->src_num++;
   }
 
   ble_stream_free();
 
-  printf("Scanning for Bluetooth Advertisement packets...\n");
+  // every report goes to capture file as well
+  if ( opts->capfile && (scan->capw = ble_cap_writer_open(opts->capfile)) == NULL ) {
+    ret = 1;
+    goto done;
+  }
+
+  printf("Scanning for Bluetooth Advertisement packets");
+  for ( i = 0 ; i < scan->src_num ; i++ )
+    printf("%s hci%d%s", i ? "," : " on", scan->src[i].dev_id, scan->src[i].ext ? " (extended)" : "");
+  printf("...\n");
 
-  if ( ble_scan_events(dd) < 0 ) {
+  getrusage(RUSAGE_SELF, &ru0);
+  start_us = mono_usec();
+
+  if ( ble_scan_events(scan) < 0 ) {
     perror("Could not receive advertising events");
-    return 1;
+    ret = 1;
   }
 
-  if ( hci_le_set_scan_enable(dd, 0x00, 0, HCI_REQ_TIMEOUT) < 0 ) {
-    perror("Disable scan failed");
+  ble_scan_usage(scan, "Scanned", start_us, &ru0);
+
+  ble_cap_writer_close(scan->capw);
+
+done:
+  for ( i = 0 ; i < scan->src_num ; i++ )
+    if ( ble_scan_disable(&scan->src[i]) < 0 )
+      ret = 1;
+
+  free(scan);
+
+return ret;
+}
+
+// Recorded reports go through scan pipeline: HCI events in ring, parsing,
+// packets, streams and output. Streams are replaced, like by loading.
+int ble_replay( char *filename, ble_scan_opts_t *opts ) {
+
+  ble_scan_t *scan;
+  ble_source_t s;
+  ble_stage_stats_t stages;
+  struct rusage ru0;
+  uint64_t start_us;
+  int ret = 0;
+
+  if ( !filename ) return 1;
+
+  if ( (ble_cap_probe(filename) ? ble_cap_source(&s, filename, 0, 0) : ble_csv_source(&s, filename, 0, 0, 0)) < 0 )
     return 1;
+
+  if ( (scan = calloc(1, sizeof(ble_scan_t))) == NULL ) {
+    perror("Could not allocate scan");
+    exit(ENOMEM);
   }
 
-  hci_close_dev(dd);
+  memset(&stages, 0, sizeof(stages));
 
-return 0;
+  scan->out.mode = opts->output;
+  scan->stages = &stages;
+  scan->src[0].replay = &s;
+  scan->src[0].speed = opts->speed;
+  scan->src[0].dev_id = -1;
+  scan->src_num = 1;
+
+  ble_stream_free();
+
+  if ( opts->capfile && (scan->capw = ble_cap_writer_open(opts->capfile)) == NULL ) {
+    ret = 1;
+    goto done;
+  }
+
+  if ( opts->speed > 0 )
+    printf("Replaying %s at %.2lfx recorded rate...\n", filename, opts->speed);
+  else
+    printf("Replaying %s as fast as possible...\n", filename);
+
+  getrusage(RUSAGE_SELF, &ru0);
+  start_us = mono_usec();
+
+  if ( ble_scan_events(scan) < 0 ) {
+    fprintf(stderr, "Replay failed\n");
+    ret = 1;
+  }
+
+  ble_scan_usage(scan, "Replayed", start_us, &ru0);
+  ble_stage_print(&stages);
+
+  ble_cap_writer_close(scan->capw);
+
+done:
+  ble_source_close(&s);
+  free(scan);
+
+return ret;
 }
 
-int ble_randaddr( btdev_t *btdev ) {
+static int ble_set_randaddr( btdev_t *btdev, int dd ) {
 
   struct hci_request rq;
   le_set_random_address_cp cp;
-  int dd = -1, status;
-
-  if (!btdev) return 1;
-
-  if ( (dd = xhci_open_dev(btdev)) < 0 )
-    return -1;
+  int status;
 
   memset(&cp, 0, sizeof(cp));
   bacpy(&cp.bdaddr, &btdev->bda);
@@ -226,12 +1256,53 @@ int ble_randaddr( btdev_t *btdev ) {
   rq.rparam = &status;
   rq.rlen = 1;
 
-  if ( hci_send_req(dd, &rq, HCI_REQ_TIMEOUT) < 0 ) {
+  if ( xhci_send_req(dd, btdev->user, &rq, HCI_REQ_TIMEOUT) < 0 ) {
     perror("Can't set random address");
     return -1;
   }
 
-  hci_close_dev(dd);
+return 0;
+}
+
+int ble_randaddr( btdev_t *btdev ) {
+
+  int dd = -1, ret;
+
+  if (!btdev) return 1;
+
+  if ( (dd = xhci_open_dev(btdev)) < 0 )
+    return -1;
+
+  ret = ble_set_randaddr(btdev, dd);
+
+  xhci_close_dev(btdev, dd);
+
+return ret;
+}
+
+static int ble_advertise_enable( btdev_t *btdev, int dd, uint8_t enable ) {
+
+  struct hci_request rq;
+  le_set_advertise_enable_cp cp;
+  uint8_t status;
+
+  cp.enable = enable;
+
+  memset(&rq, 0, sizeof(rq));
+  rq.ogf = OGF_LE_CTL;
+  rq.ocf = OCF_LE_SET_ADVERTISE_ENABLE;
+  rq.cparam = &cp;
+  rq.clen = LE_SET_ADVERTISE_ENABLE_CP_SIZE;
+  rq.rparam = &status;
+  rq.rlen = 1;
+
+  if ( xhci_send_req(dd, btdev->user, &rq, HCI_REQ_TIMEOUT) < 0 )
+    return -1;
+
+  if ( status ) {
+    errno = EIO;
+    return -1;
+  }
 
 return 0;
 }
@@ -264,9 +1335,12 @@ int ble_beacon_ga( btdev_t *btdev ) {
 
   if (!btdev) return 1;
 
-  if ( (dd = xhci_open_dev(btdev)) < 0 || ble_randaddr(btdev) < 0 )
+  if ( (dd = xhci_open_dev(btdev)) < 0 )
     return -1;
 
+  if ( ble_set_randaddr(btdev, dd) < 0 )
+    goto done;
+
   // Set BLE advertisement parameters
   le_set_advertising_parameters_cp adv_params;
   memset(&adv_params, 0, sizeof(adv_params));
@@ -284,7 +1358,7 @@ int ble_beacon_ga( btdev_t *btdev ) {
   rq.rparam = &status;
   rq.rlen = 1;
 
-  if ( hci_send_req(dd, &rq, HCI_REQ_TIMEOUT) < 0 ) {
+  if ( xhci_send_req(dd, btdev->user, &rq, HCI_REQ_TIMEOUT) < 0 ) {
     perror("Failed to set advertisement parameters data.");
     goto done;
   }
@@ -300,13 +1374,13 @@ int ble_beacon_ga( btdev_t *btdev ) {
   rq.rparam = &status;
   rq.rlen = 1;
 
-  if ( hci_send_req(dd, &rq, HCI_REQ_TIMEOUT) < 0 ) {
+  if ( xhci_send_req(dd, btdev->user, &rq, HCI_REQ_TIMEOUT) < 0 ) {
     perror("Failed to set advertising data.");
     goto done;
   }
 
   // Enable advertising
-  if ( hci_le_set_advertise_enable(dd, 0x01, HCI_REQ_TIMEOUT) < 0 ) {
+  if ( ble_advertise_enable(btdev, dd, 0x01) < 0 ) {
     perror("Failed to enable advertising.");
     goto done;
   }
@@ -315,23 +1389,30 @@ int ble_beacon_ga( btdev_t *btdev ) {
 
   print_dev_info(btdev);
 
-  abort_signal = 0;
-  signal(SIGINT, &set_abort_signal);
+  // advertise until ctrl-c
+  ble_loop_t loop;
+  sigset_t oldmask;
+
+  ble_loop_block(SIGINT, &oldmask);
+
+  if ( ble_loop_init(&loop) == 0 ) {
+
+    if ( ble_loop_signal(&loop, SIGINT, ble_loop_sigint, NULL) >= 0 )
+      ble_loop_run(&loop);
 
-  while ( !abort_signal ) {
-    usleep(1000000);
+    ble_loop_free(&loop);
   }
 
-  signal(SIGINT, SIG_DFL);
+  ble_loop_unblock(SIGINT, &oldmask);
 
   // Disable advertising
-  if ( hci_le_set_advertise_enable(dd, 0x00, HCI_REQ_TIMEOUT) < 0 ) {
+  if ( ble_advertise_enable(btdev, dd, 0x00) < 0 ) {
     perror("Failed to enable advertising.");
     goto done;
   }
 
 done:
-  hci_close_dev(dd);
+  xhci_close_dev(btdev, dd);
 
 return 0;
 }
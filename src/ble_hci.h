@@ -15,20 +15,32 @@
 #include <string.h>
 #include <signal.h>
 #include <errno.h>
+#include <pthread.h>
 #include <sys/ioctl.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/hci.h>
 #include <bluetooth/hci_lib.h>
 
 #include "ble_pkt.h"
+#include "ble_ring.h"
+#include "ble_loop.h"
+#include "ble_cap.h"
+#include "ble_out.h"
+#include "ble_source.h"
 
 #define HCI_REQ_TIMEOUT 5000
 
+// Controller setup after reset on HCI user channel, kernel does it otherwise
+#define HCI_USER_EVENT_MASK 0x20001FFFFFFFFFFFULL     // defaults and LE meta event
+#define HCI_USER_LE_EVENT_MASK 0x000000000000101FULL  // defaults and extended advertising report
+
 typedef struct {
 
   int dev_id;
   bdaddr_t bda;
+  int user;        // exclusive access through HCI user channel
 
   uint8_t irk[16]; // Identity Resolving Key
 
@@ -36,12 +48,185 @@ typedef struct {
 
 } btdev_t;
 
+// Scan pipeline: capture thread of every adapter reads HCI socket into
+// its ring, ingest thread merges rings in receive time order, parses
+// reports and adds packets to streams. Main thread waits for ctrl-c and
+// runs periodic jobs.
+#define BLE_SCAN_TICK_MS 1000
+#define BLE_SCAN_SRC_MAX 8
+#define BLE_SCAN_MERGE_US 50000   // max time event waits for older ones from other adapters
+
+// Batch room for all reports of one event. Num_Reports is at most 0x19
+// for legacy and extended report events, extended one completes at most
+// one reassembled advertisement. Event that doesn't fit anyway is taken
+// again with next batch, from the first report that wasn't taken.
+#define BLE_SCAN_EVENT_REPORTS 25
+#define BLE_SCAN_EVENT_BYTES 4096
+#define BLE_SCAN_EVENT_FULL 1     // batch is full, event stays in ring
+
+// Replay of recorded reports through scan pipeline
+#define BLE_SCAN_REPLAY_DATA_MAX (255 - 3 - sizeof(le_advertising_info))   // longer data is cut to fit event
+#define BLE_SCAN_REPLAY_NOTIFY 64                 // events committed before ingest is woken up
+#define BLE_SCAN_REPLAY_SLEEP_NS 10000000         // max sleep, stop is checked after it
+#define BLE_SCAN_REPLAY_FULL_NS 100000            // wait for ingest when ring is full
+
+// LE extended scanning, Bluetooth 5.0 Core Vol 4 Part E 7.8.64, 7.8.65, 7.7.65.13
+#ifndef OCF_LE_SET_EXT_SCAN_PARAMETERS
+#define OCF_LE_SET_EXT_SCAN_PARAMETERS 0x0041
+#endif
+#ifndef OCF_LE_SET_EXT_SCAN_ENABLE
+#define OCF_LE_SET_EXT_SCAN_ENABLE 0x0042
+#endif
+#ifndef EVT_LE_EXT_ADVERTISING_REPORT
+#define EVT_LE_EXT_ADVERTISING_REPORT 0x0D
+#endif
+
+#define BLE_LE_FEAT_EXT_ADV 12    // bit in LE supported features
+#define BLE_SCAN_PHY_1M 0x01
+
+typedef struct {
+
+  uint8_t own_bdaddr_type;
+  uint8_t filter;
+  uint8_t phys;         // one set of parameters follows for every PHY
+  uint8_t type;
+  uint16_t interval;
+  uint16_t window;
+
+} __attribute__ ((packed)) ble_ext_scan_params_cp;
+
+typedef struct {
+
+  uint8_t enable;
+  uint8_t filter_dup;
+  uint16_t duration;
+  uint16_t period;
+
+} __attribute__ ((packed)) ble_ext_scan_enable_cp;
+
+typedef struct {
+
+  uint16_t evt_type;
+  uint8_t bdaddr_type;
+  bdaddr_t bdaddr;
+  uint8_t primary_phy;
+  uint8_t secondary_phy;
+  uint8_t sid;
+  int8_t tx_power;
+  int8_t rssi;
+  uint16_t periodic_interval;
+  uint8_t direct_bdaddr_type;
+  bdaddr_t direct_bdaddr;
+  uint8_t length;
+  uint8_t data[0];
+
+} __attribute__ ((packed)) ble_ext_adv_info;
+
+#define BLE_EXT_EVT_LEGACY 0x0010
+#define BLE_EXT_EVT_STATUS(t) (((t) >> 5) & 0x03)   // 0 - complete, 1 - more data to come, 2 - truncated
+#define BLE_EXT_EVT_MORE 1
+#define BLE_EXT_EVT_TYPE 0x80     // evt_type of packets sent as extended PDUs, low bits are event properties
+
+// Data of extended advertisement may come in several reports, it's put
+// together per advertiser. Packets hold at most 255 bytes of it.
+#define BLE_SCAN_FRAGS 8
+#define BLE_SCAN_FRAG_MAX 255
+
+typedef struct {
+
+  uint8_t used;
+  uint8_t sid;
+  uint64_t recv_us;     // of first fragment
+  uint8_t buf[sizeof(le_advertising_info) + BLE_SCAN_FRAG_MAX + 1];   // report with RSSI byte
+
+} ble_scan_frag_t;
+
+// LE scan parameters, interval and window in 0.625ms units
+#define BLE_SCAN_UNITS_US 625
+#define BLE_SCAN_INTERVAL_MIN 0x0004
+#define BLE_SCAN_INTERVAL_MAX 0x4000
+
+typedef struct {
+
+  uint8_t type;         // 0 - passive, 1 - active
+  uint16_t interval;
+  uint16_t window;      // not longer than interval
+  uint8_t own_type;     // LE_PUBLIC_ADDRESS or LE_RANDOM_ADDRESS
+  uint8_t filter;       // 0 - accept all, 1 - whitelist
+  uint8_t filter_dup;   // controller drops duplicate reports
+  uint8_t ext;          // use extended scanning if controller supports it
+
+} ble_scan_params_t;
+
+extern ble_scan_params_t ble_scan_params;
+
+typedef struct {
+
+  char *capfile;        // write capture file while scanning
+  ble_out_mode output;
+
+  int dev_ids[BLE_SCAN_SRC_MAX];   // adapters, selected device if none
+  int dev_num;
+
+  double speed;         // replay rate relative to recorded time, 0 is as fast as possible
+
+} ble_scan_opts_t;
+
+typedef struct ble_scan_s ble_scan_t;
+
+// Capture source, one adapter or recorded reports being replayed
+typedef struct {
+
+  ble_scan_t *scan;
+  ble_source_t *replay; // reports replayed as HCI events, instead of adapter
+  double speed;
+  int dev_id;
+  int dd;
+  int user;             // dd is HCI user channel
+  int ext;              // extended scanning is enabled
+  struct hci_filter of; // socket filter to restore
+
+  ble_scan_frag_t frags[BLE_SCAN_FRAGS];   // owned by ingest thread
+  uint32_t taken;                          // reports of oldest event already in batch
+
+  ble_ring_t ring;
+  ble_loop_t loop;      // capture thread: HCI socket
+  pthread_t thread;
+
+  atomic_int stop;      // capture thread finished
+  int error;            // errno of failed socket read
+
+  atomic_uint_fast64_t reports;   // counted by ingest thread
+  uint64_t tick_reports;          // at last tick
+  uint32_t rate;                  // reports per second
+  uint32_t peak_rate;
+
+} ble_scan_src_t;
+
+struct ble_scan_s {
+
+  ble_scan_src_t src[BLE_SCAN_SRC_MAX];
+  int src_num;
+
+  ble_cap_writer_t *capw;
+  ble_out_t out;
+
+  ble_loop_t ctl;       // main thread: signals and timers
+
+  ble_stage_stats_t *stages;    // ingest latency, replay only
+
+};
+
 int xhci_dev_info(int s, int dev_id, long arg);
 int xhci_open_dev( btdev_t *btdev );
+void xhci_close_dev( btdev_t *btdev, int dd );
+int xhci_send_req( int dd, int user, struct hci_request *rq, int to );
 
 int ble_randaddr( btdev_t *btdev );
 
-int ble_scan( btdev_t *btdev );
+int ble_scan_events( ble_scan_t *scan );
+int ble_scan( btdev_t *btdev, ble_scan_opts_t *opts );
+int ble_replay( char *filename, ble_scan_opts_t *opts );
 int ble_beacon_ga( btdev_t *btdev );
 
 #endif // __BLE_HCI_H__
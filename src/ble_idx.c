@@ -0,0 +1,121 @@
+/*
+ *
+ * Adrian Brzezinski (2020) <adrian.brzezinski at adrb.pl>
+ * License: GPLv2+
+ *
+ */
+
+#include "bentool.h"
+
+// FNV-1a, keys are short and mostly random anyway
+static inline uint32_t ble_idx_hash( ble_idx_t *idx, const uint8_t *key ) {
+
+  uint64_t h = 0xcbf29ce484222325ULL;
+
+  for ( int i = 0 ; i < idx->key_len ; i++ ) {
+    h ^= key[i];
+    h *= 0x100000001b3ULL;
+  }
+
+return (uint32_t)(h ^ (h >> 32));
+}
+
+static ble_idx_slot_t *ble_idx_lookup( ble_idx_t *idx, const void *key ) {
+
+  ble_idx_slot_t *slot;
+  uint32_t mask = idx->size - 1;
+  uint32_t i = ble_idx_hash(idx, key) & mask;
+
+  for ( ;; i = (i + 1) & mask ) {
+
+    slot = &idx->slots[i];
+
+    if ( !slot->val || !memcmp(slot->key, key, idx->key_len) )
+      return slot;
+  }
+
+}
+
+static void ble_idx_resize( ble_idx_t *idx, uint32_t size ) {
+
+  ble_idx_slot_t *old_slots = idx->slots;
+  uint32_t old_size = idx->size;
+
+  if ( (idx->slots = calloc(size, sizeof(ble_idx_slot_t))) == NULL ) {
+    perror("Could not allocate stream index");
+    exit(ENOMEM);
+  }
+
+  idx->size = size;
+
+  for ( uint32_t i = 0 ; i < old_size ; i++ ) {
+
+    if ( !old_slots[i].val ) continue;
+
+    *ble_idx_lookup(idx, old_slots[i].key) = old_slots[i];
+  }
+
+  free(old_slots);
+}
+
+void *ble_idx_get( ble_idx_t *idx, const void *key ) {
+
+  if ( !idx->used ) return NULL;
+
+return ble_idx_lookup(idx, key)->val;
+}
+
+void ble_idx_set( ble_idx_t *idx, const void *key, void *val ) {
+
+  ble_idx_slot_t *slot;
+
+  // keep load factor below 50%
+  if ( (idx->used + 1) << 1 > idx->size )
+    ble_idx_resize(idx, idx->size ? idx->size << 1 : BLE_IDX_MIN_SIZE);
+
+  slot = ble_idx_lookup(idx, key);
+
+  if ( !slot->val ) {
+    memcpy(slot->key, key, idx->key_len);
+    idx->used++;
+  }
+
+  slot->val = val;
+}
+
+// Backward shift deletion, so we don't need tombstones
+void ble_idx_del( ble_idx_t *idx, const void *key, void *val ) {
+
+  ble_idx_slot_t *slot;
+  uint32_t mask = idx->size - 1, i, j, home;
+
+  if ( !idx->used ) return;
+
+  slot = ble_idx_lookup(idx, key);
+  if ( !slot->val || slot->val != val ) return;
+
+  i = slot - idx->slots;
+
+  for ( j = (i + 1) & mask ; idx->slots[j].val ; j = (j + 1) & mask ) {
+
+    home = ble_idx_hash(idx, idx->slots[j].key) & mask;
+
+    // move entry only if its home slot isn't located cyclically in (i, j]
+    if ( ((j - home) & mask) >= ((j - i) & mask) ) {
+      idx->slots[i] = idx->slots[j];
+      i = j;
+    }
+  }
+
+  idx->slots[i].val = NULL;
+  idx->used--;
+}
+
+void ble_idx_free( ble_idx_t *idx ) {
+
+  free(idx->slots);
+
+  idx->slots = NULL;
+  idx->size = 0;
+  idx->used = 0;
+}
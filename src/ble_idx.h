@@ -0,0 +1,44 @@
+/*
+ *
+ * Adrian Brzezinski (2020) <adrian.brzezinski at adrb.pl>
+ * License: GPLv2+
+ *
+ */
+
+#ifndef __BLE_IDX_H__
+#define __BLE_IDX_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define BLE_IDX_KEY_MAX 20    // RPI + AEM
+#define BLE_IDX_MIN_SIZE 1024
+
+typedef struct {
+
+  uint8_t key[BLE_IDX_KEY_MAX];
+  void *val;    // NULL marks empty slot
+
+} ble_idx_slot_t;
+
+// Open addressing (linear probing) hash index of fixed length keys
+typedef struct {
+
+  ble_idx_slot_t *slots;
+  uint32_t size;      // always power of 2
+  uint32_t used;
+
+  uint8_t key_len;
+
+} ble_idx_t;
+
+void *ble_idx_get( ble_idx_t *idx, const void *key );
+void ble_idx_set( ble_idx_t *idx, const void *key, void *val );
+void ble_idx_del( ble_idx_t *idx, const void *key, void *val );  // delete only if key points to val
+void ble_idx_free( ble_idx_t *idx );
+
+static inline size_t ble_idx_mem( ble_idx_t *idx ) {
+  return (size_t)idx->size * sizeof(ble_idx_slot_t);
+}
+
+#endif // __BLE_IDX_H__
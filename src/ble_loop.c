@@ -0,0 +1,209 @@
+/*
+ *
+ * Adrian Brzezinski (2020) <adrian.brzezinski at adrb.pl>
+ * License: GPLv2+
+ *
+ */
+
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+
+#include "bentool.h"
+
+static int ble_loop_watch( ble_loop_t *loop, int fd, ble_loop_kind kind, ble_loop_cb cb, void *arg ) {
+
+  struct epoll_event ev = { .events = EPOLLIN };
+  ble_loop_fd_t *lfd;
+
+  if ( loop->num == BLE_LOOP_MAX ) {
+    fprintf(stderr, "Too many descriptors in event loop\n");
+    return -1;
+  }
+
+  lfd = &loop->fds[loop->num];
+  lfd->fd = fd;
+  lfd->kind = kind;
+  lfd->cb = cb;
+  lfd->arg = arg;
+
+  ev.data.ptr = lfd;
+
+  if ( epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) < 0 ) {
+    perror("Could not watch descriptor");
+    return -1;
+  }
+
+  loop->num++;
+
+return fd;
+}
+
+int ble_loop_init( ble_loop_t *loop ) {
+
+  int efd;
+
+  memset(loop, 0, sizeof(ble_loop_t));
+  atomic_init(&loop->stop, 0);
+
+  if ( (loop->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0 ) {
+    perror("Could not create event loop");
+    return -1;
+  }
+
+  // written by ble_loop_stop() to interrupt epoll_wait()
+  if ( (efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0 )
+    perror("Could not create event loop");
+
+  if ( efd < 0 || ble_loop_watch(loop, efd, BLE_LOOP_WAKE, NULL, NULL) < 0 ) {
+    if ( efd >= 0 ) close(efd);
+    close(loop->epfd);
+    loop->epfd = -1;
+    return -1;
+  }
+
+return 0;
+}
+
+// Descriptor stays owned by caller
+int ble_loop_add( ble_loop_t *loop, int fd, ble_loop_cb cb, void *arg ) {
+  return ble_loop_watch(loop, fd, BLE_LOOP_FD, cb, arg);
+}
+
+int ble_loop_timer( ble_loop_t *loop, uint32_t interval_ms, ble_loop_cb cb, void *arg ) {
+
+  struct itimerspec its;
+  int fd;
+
+  if ( (fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK)) < 0 ) {
+    perror("Could not create timer");
+    return -1;
+  }
+
+  its.it_interval.tv_sec = interval_ms / 1000;
+  its.it_interval.tv_nsec = (interval_ms % 1000) * 1000000;
+  its.it_value = its.it_interval;
+
+  if ( timerfd_settime(fd, 0, &its, NULL) < 0 || ble_loop_watch(loop, fd, BLE_LOOP_TIMER, cb, arg) < 0 ) {
+    close(fd);
+    return -1;
+  }
+
+return fd;
+}
+
+int ble_loop_signal( ble_loop_t *loop, int sig, ble_loop_cb cb, void *arg ) {
+
+  sigset_t mask;
+  int fd;
+
+  sigemptyset(&mask);
+  sigaddset(&mask, sig);
+
+  if ( (fd = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK)) < 0 ) {
+    perror("Could not create signalfd");
+    return -1;
+  }
+
+  if ( ble_loop_watch(loop, fd, BLE_LOOP_SIGNAL, cb, arg) < 0 ) {
+    close(fd);
+    return -1;
+  }
+
+return fd;
+}
+
+int ble_loop_run( ble_loop_t *loop ) {
+
+  struct epoll_event evs[BLE_LOOP_MAX];
+  ble_loop_fd_t *lfd;
+  struct signalfd_siginfo si;
+  uint64_t cnt;
+  int n, i;
+
+  while ( !atomic_load(&loop->stop) ) {
+
+    if ( (n = epoll_wait(loop->epfd, evs, BLE_LOOP_MAX, -1)) < 0 ) {
+
+      if ( errno == EINTR ) continue;
+
+      perror("Event loop failed");
+      return -1;
+    }
+
+    // handle everything that's ready before waiting again
+    for ( i = 0 ; i < n && !atomic_load(&loop->stop) ; i++ ) {
+
+      lfd = evs[i].data.ptr;
+
+      switch ( lfd->kind ) {
+
+      case BLE_LOOP_WAKE:
+      case BLE_LOOP_TIMER:
+        if ( read(lfd->fd, &cnt, sizeof(cnt)) < 0 ) continue;
+      break;
+
+      case BLE_LOOP_SIGNAL:
+        if ( read(lfd->fd, &si, sizeof(si)) < 0 ) continue;
+      break;
+
+      case BLE_LOOP_FD:
+      break;
+      }
+
+      if ( lfd->cb ) lfd->cb(loop, lfd->fd, lfd->arg);
+    }
+  }
+
+return 0;
+}
+
+void ble_loop_stop( ble_loop_t *loop ) {
+
+  uint64_t one = 1;
+
+  atomic_store(&loop->stop, 1);
+
+  // wake fd is always first one
+  if ( write(loop->fds[0].fd, &one, sizeof(one)) < 0 )
+    perror("Could not wake event loop");
+}
+
+// Closes descriptors created by loop
+void ble_loop_free( ble_loop_t *loop ) {
+
+  for ( int i = 0 ; i < loop->num ; i++ )
+    if ( loop->fds[i].kind != BLE_LOOP_FD )
+      close(loop->fds[i].fd);
+
+  if ( loop->epfd >= 0 ) close(loop->epfd);
+
+  memset(loop, 0, sizeof(ble_loop_t));
+  loop->epfd = -1;
+}
+
+void ble_loop_block( int sig, sigset_t *old ) {
+
+  sigset_t mask;
+
+  sigemptyset(&mask);
+  sigaddset(&mask, sig);
+
+  pthread_sigmask(SIG_BLOCK, &mask, old);
+}
+
+// Pending signal is consumed, otherwise it would be delivered right after unblocking
+void ble_loop_unblock( int sig, sigset_t *old ) {
+
+  struct timespec ts = { 0, 0 };
+  sigset_t mask;
+
+  sigemptyset(&mask);
+  sigaddset(&mask, sig);
+
+  while ( sigtimedwait(&mask, NULL, &ts) == sig );
+
+  pthread_sigmask(SIG_SETMASK, old, NULL);
+}
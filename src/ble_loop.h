@@ -0,0 +1,69 @@
+/*
+ *
+ * Adrian Brzezinski (2020) <adrian.brzezinski at adrb.pl>
+ * License: GPLv2+
+ *
+ */
+
+#ifndef __BLE_LOOP_H__
+#define __BLE_LOOP_H__
+
+#include <stdint.h>
+#include <signal.h>
+#include <stdatomic.h>
+
+// Small epoll based event loop. Watches descriptors, timers (timerfd) and
+// signals (signalfd), handles every ready descriptor on each wakeup.
+// Can be stopped from any thread.
+#define BLE_LOOP_MAX 16
+
+typedef struct ble_loop_s ble_loop_t;
+
+typedef void (*ble_loop_cb)( ble_loop_t *loop, int fd, void *arg );
+
+typedef enum {
+
+  BLE_LOOP_FD,
+  BLE_LOOP_TIMER,
+  BLE_LOOP_SIGNAL,
+  BLE_LOOP_WAKE,
+
+} ble_loop_kind;
+
+typedef struct {
+
+  int fd;
+  ble_loop_kind kind;
+  ble_loop_cb cb;
+  void *arg;
+
+} ble_loop_fd_t;
+
+struct ble_loop_s {
+
+  int epfd;
+  atomic_int stop;
+
+  int num;
+  ble_loop_fd_t fds[BLE_LOOP_MAX];
+
+};
+
+int ble_loop_init( ble_loop_t *loop );
+int ble_loop_add( ble_loop_t *loop, int fd, ble_loop_cb cb, void *arg );
+int ble_loop_timer( ble_loop_t *loop, uint32_t interval_ms, ble_loop_cb cb, void *arg );
+int ble_loop_signal( ble_loop_t *loop, int sig, ble_loop_cb cb, void *arg );   // sig has to be blocked
+int ble_loop_run( ble_loop_t *loop );
+void ble_loop_stop( ble_loop_t *loop );
+
+static inline int ble_loop_stopped( ble_loop_t *loop ) {
+  return atomic_load(&loop->stop);
+}
+void ble_loop_free( ble_loop_t *loop );
+
+// Signals handled by loop have to be blocked in every thread,
+// so block them before other threads are created
+void ble_loop_block( int sig, sigset_t *old );
+void ble_loop_unblock( int sig, sigset_t *old );
+
+#endif // __BLE_LOOP_H__
@@ -0,0 +1,322 @@
+/*
+ *
+ * Adrian Brzezinski (2020) <adrian.brzezinski at adrb.pl>
+ * License: GPLv2+
+ *
+ */
+
+#include "bentool.h"
+
+static const char *ble_out_modes[] = {
+  [BLE_OUT_ALL] = "all",
+  [BLE_OUT_CHANGES] = "changes",
+  [BLE_OUT_SUMMARY] = "summary",
+};
+
+int ble_out_mode_parse( const char *str, ble_out_mode *mode ) {
+
+  for ( int i = 0 ; i < sizeof(ble_out_modes)/sizeof(ble_out_modes[0]) ; i++ ) {
+    if ( !strcmp(str, ble_out_modes[i]) ) {
+      *mode = i;
+      return 0;
+    }
+  }
+
+return -1;
+}
+
+// Formatted date of usec, same as print_usec()
+static char* ble_out_date( ble_out_t *out, uint64_t usec, char *buf ) {
+
+  time_t sec = usec / 1000000;
+  struct tm *tm;
+
+  if ( sec != out->date_sec ) {
+    tm = localtime(&sec);
+    strftime(out->date, sizeof(out->date), "%Y-%m-%d %H:%M:%S", tm);
+    out->date_sec = sec;
+  }
+
+  sprintf(buf, "%s.%03d", out->date, (int)(usec % 1000000 / 1000));
+
+return buf;
+}
+
+static void ble_out_line( ble_out_t *out, ble_out_rec_t *rec ) {
+
+  char date[32], addr[18], rpi[33], aem[9];
+
+  if ( out->lines >= BLE_OUT_RATE ) {
+    out->suppressed++;
+    return;
+  }
+
+  out->lines++;
+
+  ba2str(&rec->bda, addr);
+  *hexencode(rpi, rec->rpi, 16) = 0;
+  *hexencode(aem, rec->aem, 4) = 0;
+
+  printf("%s, BDA: %s, RSSI: %d, RPI: %s, AEM: %s\n",
+    ble_out_date(out, rec->recv_us, date), addr, rec->rssi, rpi, aem);
+}
+
+// Update device table, returns 1 if address or RPI is new
+static int ble_out_update( ble_out_t *out, ble_out_rec_t *rec ) {
+
+  ble_out_dev_t *dev;
+  uintptr_t i;
+  int changed = 0;
+
+  if ( (i = (uintptr_t)ble_idx_get(&out->map, &rec->bda)) ) {
+
+    dev = &out->devs[i - 1];
+    changed = memcmp(dev->rpi, rec->rpi, 16) != 0;
+
+  } else {
+
+    if ( out->dev_num == out->dev_size ) {
+
+      out->dev_size = out->dev_size ? out->dev_size << 1 : 256;
+
+      if ( (out->devs = realloc(out->devs, out->dev_size * sizeof(ble_out_dev_t))) == NULL ) {
+        perror("Could not allocate output table");
+        exit(ENOMEM);
+      }
+    }
+
+    dev = &out->devs[out->dev_num++];
+    memset(dev, 0, sizeof(ble_out_dev_t));
+    bacpy(&dev->bda, &rec->bda);
+    dev->first_us = rec->recv_us;
+
+    ble_idx_set(&out->map, &dev->bda, (void*)(uintptr_t)out->dev_num);
+    changed = 1;
+  }
+
+  if ( rec->recv_us > out->now_us ) out->now_us = rec->recv_us;
+
+  dev->rssi = rec->rssi;
+  dev->last_us = rec->recv_us;
+  dev->pkts++;
+  memcpy(dev->rpi, rec->rpi, 16);
+  memcpy(dev->aem, rec->aem, 4);
+
+return changed;
+}
+
+// Drop devices not seen for a while, last one is moved in place of removed one
+static void ble_out_expire( ble_out_t *out, uint64_t now_us ) {
+
+  ble_out_dev_t *dev;
+  uint32_t i = 0;
+
+  while ( i < out->dev_num ) {
+
+    dev = &out->devs[i];
+
+    if ( dev->last_us + BLE_OUT_EXPIRE_US >= now_us ) {
+      i++;
+      continue;
+    }
+
+    ble_idx_del(&out->map, &dev->bda, (void*)(uintptr_t)(i + 1));
+
+    if ( i != --out->dev_num ) {
+      ble_idx_del(&out->map, &out->devs[out->dev_num].bda, (void*)(uintptr_t)(out->dev_num + 1));
+      *dev = out->devs[out->dev_num];
+      ble_idx_set(&out->map, &dev->bda, (void*)(uintptr_t)(i + 1));
+    }
+  }
+}
+
+static void ble_out_summary( ble_out_t *out, uint64_t dropped ) {
+
+  ble_out_dev_t *rows[BLE_OUT_ROWS], *dev;
+  char date[32] = "-", addr[18], rpi[33];
+  uint32_t i, j, num = 0;
+
+  // most recently seen devices first, insertion into short sorted list
+  for ( i = 0 ; i < out->dev_num ; i++ ) {
+
+    dev = &out->devs[i];
+
+    if ( num == BLE_OUT_ROWS && dev->last_us <= rows[num - 1]->last_us )
+      continue;
+
+    if ( num < BLE_OUT_ROWS ) num++;
+
+    for ( j = num - 1 ; j > 0 && rows[j - 1]->last_us < dev->last_us ; j-- )
+      rows[j] = rows[j - 1];
+
+    rows[j] = dev;
+  }
+
+  if ( out->now_us ) ble_out_date(out, out->now_us, date);
+
+  printf("\n%s, devices %u, reports %lu, dropped from output %lu\n", date, out->dev_num, (unsigned long)out->reports, (unsigned long)dropped);
+  printf("%-17s  %4s  %8s  %6s  %s\n", "BDA", "RSSI", "PACKETS", "SEEN", "RPI");
+
+  for ( i = 0 ; i < num ; i++ ) {
+
+    ba2str(&rows[i]->bda, addr);
+    *hexencode(rpi, rows[i]->rpi, 16) = 0;
+
+    printf("%-17s  %4d  %8u  %5lus  %s\n", addr, rows[i]->rssi, rows[i]->pkts,
+      (unsigned long)((rows[i]->last_us - rows[i]->first_us) / 1000000), rpi);
+  }
+}
+
+// Devices expire in receive time, so replay of old capture keeps its table
+static void ble_out_flush_tick( ble_out_t *out, uint64_t dropped ) {
+
+  if ( out->mode == BLE_OUT_SUMMARY ) {
+    ble_out_summary(out, dropped);
+  } else if ( out->suppressed ) {
+    printf("... %lu lines suppressed\n", (unsigned long)out->suppressed);
+  }
+
+  ble_out_expire(out, out->now_us);
+
+  out->lines = 0;
+  out->suppressed = 0;
+  out->reports = 0;
+}
+
+// Output thread, takes whole queue at once and prints it
+static void* ble_out_run( void *arg ) {
+
+  ble_out_t *out = arg;
+  ble_out_rec_t *rec;
+  uint64_t dropped;
+  uint32_t num, i;
+  int stop, tick;
+
+  for (;;) {
+
+    pthread_mutex_lock(&out->lock);
+
+    while ( !out->stop && !out->tick && !out->num ) {
+      out->waiting = 1;
+      pthread_cond_wait(&out->cond, &out->lock);
+      out->waiting = 0;
+    }
+
+    num = out->num;
+    for ( i = 0 ; i < num ; i++ )
+      out->batch[i] = out->queue[(out->head + i) % BLE_OUT_QUEUE];
+
+    out->head = (out->head + num) % BLE_OUT_QUEUE;
+    out->num = 0;
+
+    stop = out->stop;
+    tick = out->tick;
+    dropped = out->dropped;
+    out->tick = 0;
+
+    pthread_mutex_unlock(&out->lock);
+
+    for ( i = 0 ; i < num ; i++ ) {
+
+      rec = &out->batch[i];
+
+      if ( ble_out_update(out, rec) || out->mode == BLE_OUT_ALL ) {
+        if ( out->mode != BLE_OUT_SUMMARY ) ble_out_line(out, rec);
+      }
+    }
+
+    out->reports += num;
+
+    if ( tick ) ble_out_flush_tick(out, dropped);
+
+    fflush(stdout);
+
+    if ( stop ) break;
+  }
+
+return NULL;
+}
+
+int ble_out_start( ble_out_t *out, ble_out_mode mode ) {
+
+  memset(out, 0, sizeof(ble_out_t));
+
+  out->mode = mode;
+  out->map.key_len = sizeof(bdaddr_t);
+
+  if ( (out->queue = malloc(BLE_OUT_QUEUE * sizeof(ble_out_rec_t))) == NULL ||
+       (out->batch = malloc(BLE_OUT_QUEUE * sizeof(ble_out_rec_t))) == NULL ) {
+    perror("Could not allocate output queue");
+    exit(ENOMEM);
+  }
+
+  pthread_mutex_init(&out->lock, NULL);
+  pthread_cond_init(&out->cond, NULL);
+
+  if ( pthread_create(&out->thread, NULL, ble_out_run, out) ) {
+    perror("Couldn't start output thread");
+    free(out->queue);
+    free(out->batch);
+    return -1;
+  }
+
+return 0;
+}
+
+// Queue EN report for output, never waits for terminal
+void ble_out_add( ble_out_t *out, ble_pkt_t *pkt ) {
+
+  ble_out_rec_t *rec;
+
+  if ( pkt->data_type != BLE_GA_EN ) return;
+
+  pthread_mutex_lock(&out->lock);
+
+  if ( out->num == BLE_OUT_QUEUE ) {
+    out->dropped++;
+    pthread_mutex_unlock(&out->lock);
+    return;
+  }
+
+  rec = &out->queue[(out->head + out->num++) % BLE_OUT_QUEUE];
+  rec->recv_us = pkt->recv_us;
+  rec->rssi = pkt->rssi;
+  bacpy(&rec->bda, &pkt->bda);
+  memcpy(rec->rpi, pkt->data.ga.rpi, 16);
+  memcpy(rec->aem, pkt->data.ga.aem, 4);
+
+  if ( out->waiting ) pthread_cond_signal(&out->cond);
+
+  pthread_mutex_unlock(&out->lock);
+}
+
+// Starts new rate limit period, prints summary
+void ble_out_tick( ble_out_t *out ) {
+
+  pthread_mutex_lock(&out->lock);
+  out->tick = 1;
+  pthread_cond_signal(&out->cond);
+  pthread_mutex_unlock(&out->lock);
+}
+
+// Prints what's still queued and waits for output thread
+void ble_out_stop( ble_out_t *out ) {
+
+  pthread_mutex_lock(&out->lock);
+  out->stop = 1;
+  pthread_cond_signal(&out->cond);
+  pthread_mutex_unlock(&out->lock);
+
+  pthread_join(out->thread, NULL);
+
+  if ( out->dropped )
+    printf("%lu reports dropped from output\n", (unsigned long)out->dropped);
+
+  pthread_mutex_destroy(&out->lock);
+  pthread_cond_destroy(&out->cond);
+
+  ble_idx_free(&out->map);
+  free(out->devs);
+  free(out->queue);
+  free(out->batch);
+}
@@ -0,0 +1,96 @@
+/*
+ *
+ * Adrian Brzezinski (2020) <adrian.brzezinski at adrb.pl>
+ * License: GPLv2+
+ *
+ */
+
+#ifndef __BLE_OUT_H__
+#define __BLE_OUT_H__
+
+#include <stdint.h>
+#include <pthread.h>
+#include <bluetooth/bluetooth.h>
+
+#include "ble_idx.h"
+#include "ble_pkt.h"
+
+// Console output of scan. Ingest thread only queues EN reports, output
+// thread formats and prints them. Queue is bounded, when terminal can't
+// keep up reports are dropped from output (never from capture).
+#define BLE_OUT_QUEUE 4096
+#define BLE_OUT_RATE 100                  // max lines per tick in all and changes modes
+#define BLE_OUT_ROWS 20                   // summary table rows
+#define BLE_OUT_EXPIRE_US 60000000ULL     // forget devices not seen for that long
+
+typedef enum {
+
+  BLE_OUT_ALL,      // every report
+  BLE_OUT_CHANGES,  // new address or new RPI
+  BLE_OUT_SUMMARY,  // table of devices every tick
+
+} ble_out_mode;
+
+typedef struct {
+
+  uint64_t recv_us;
+  bdaddr_t bda;
+  int8_t rssi;
+  uint8_t rpi[16];
+  uint8_t aem[4];
+
+} ble_out_rec_t;
+
+typedef struct {
+
+  bdaddr_t bda;
+  int8_t rssi;
+  uint8_t rpi[16];
+  uint8_t aem[4];
+
+  uint64_t first_us;
+  uint64_t last_us;
+  uint32_t pkts;
+
+} ble_out_dev_t;
+
+typedef struct {
+
+  ble_out_mode mode;
+
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int stop;
+  int tick;
+  int waiting;          // output thread sleeps on cond
+
+  ble_out_rec_t *queue; // circular, BLE_OUT_QUEUE records
+  uint32_t head;
+  uint32_t num;
+  uint64_t dropped;
+
+  // owned by output thread
+  ble_out_rec_t *batch;
+  ble_idx_t map;        // address -> device index + 1
+  ble_out_dev_t *devs;
+  uint32_t dev_num;
+  uint32_t dev_size;
+  uint32_t lines;       // printed in current tick
+  uint64_t suppressed;
+  uint64_t reports;     // since last tick
+  uint64_t now_us;      // newest report receive time, clock of expiry and summary
+
+  time_t date_sec;      // localtime() is called once a second
+  char date[32];
+
+} ble_out_t;
+
+int ble_out_mode_parse( const char *str, ble_out_mode *mode );
+
+int ble_out_start( ble_out_t *out, ble_out_mode mode );
+void ble_out_add( ble_out_t *out, ble_pkt_t *pkt );
+void ble_out_tick( ble_out_t *out );
+void ble_out_stop( ble_out_t *out );
+
+#endif // __BLE_OUT_H__
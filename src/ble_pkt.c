@@ -7,6 +7,177 @@
 
 #include "bentool.h"
 
+ble_pkt_t **ble_pkt_slab = NULL;         // packet records
+uint32_t ble_pkt_slab_size = 0;          // chunk table size
+uint32_t ble_pkt_num = 0;                // records allocated
+uint32_t ble_pkt_live = 0;               // records in use
+uint32_t ble_pkt_free_id = UINT32_MAX;   // released records, linked through recv_us
+
+ble_pkt_chunk_t *ble_pkt_side = NULL;    // advertising data of not EN packets
+void *ble_pkt_side_free[BLE_PKT_SIDE_BUCKETS];
+size_t ble_pkt_side_used = 0;
+
+static void* ble_pkt_arena_alloc( ble_pkt_chunk_t **arena, size_t len ) {
+
+  ble_pkt_chunk_t *chunk = *arena;
+  void *ptr;
+
+  // keep allocations aligned
+  len = (len + 7) & ~(size_t)7;
+
+  if ( !chunk || chunk->size - chunk->used < len ) {
+
+    size_t size = len > BLE_PKT_ARENA_CHUNK ? len : BLE_PKT_ARENA_CHUNK;
+
+    if ( (chunk = malloc(sizeof(ble_pkt_chunk_t) + size)) == NULL ) {
+      return NULL;
+    }
+
+    chunk->size = size;
+    chunk->used = 0;
+    chunk->next = *arena;
+    *arena = chunk;
+  }
+
+  ptr = chunk->data + chunk->used;
+  chunk->used += len;
+
+  memset(ptr, 0, len);
+
+return ptr;
+}
+
+static void ble_pkt_arena_release( ble_pkt_chunk_t **arena ) {
+
+  ble_pkt_chunk_t *chunk, *next;
+
+  for ( chunk = *arena ; chunk ; chunk = next ) {
+    next = chunk->next;
+    free(chunk);
+  }
+
+  *arena = NULL;
+}
+
+static void* ble_pkt_side_alloc( size_t len ) {
+
+  size_t b = (len + 7) >> 3;
+  void *ptr;
+
+  ble_pkt_side_used += b << 3;
+
+  if ( b < BLE_PKT_SIDE_BUCKETS && (ptr = ble_pkt_side_free[b]) ) {
+    memcpy(&ble_pkt_side_free[b], ptr, sizeof(void*));
+    memset(ptr, 0, len);
+    return ptr;
+  }
+
+return ble_pkt_arena_alloc(&ble_pkt_side, len);
+}
+
+static void ble_pkt_side_release( void *ptr, size_t len ) {
+
+  size_t b = (len + 7) >> 3;
+
+  ble_pkt_side_used -= b << 3;
+
+  // block too big for buckets stays in arena until it's freed
+  if ( b >= BLE_PKT_SIDE_BUCKETS ) return;
+
+  memcpy(ptr, &ble_pkt_side_free[b], sizeof(void*));
+  ble_pkt_side_free[b] = ptr;
+}
+
+// Allocate zeroed packet, with advinfo_len bytes of advertising data in side buffer
+ble_pkt_t* ble_pkt_alloc( size_t advinfo_len ) {
+
+  ble_pkt_t *pkt;
+  uint32_t chunk = ble_pkt_num >> BLE_PKT_SLAB_SHIFT, id;
+
+  // reuse released record
+  if ( ble_pkt_free_id != UINT32_MAX ) {
+
+    id = ble_pkt_free_id;
+    pkt = ble_pkt_get(id);
+    ble_pkt_free_id = pkt->recv_us;
+
+    goto ble_pkt_alloc_init;
+  }
+
+  // first record in chunk?
+  if ( !(ble_pkt_num & (BLE_PKT_SLAB_CHUNK - 1)) ) {
+
+    if ( chunk == ble_pkt_slab_size ) {
+
+      uint32_t size = ble_pkt_slab_size ? ble_pkt_slab_size << 1 : 64;
+      ble_pkt_t **slab;
+
+      if ( (slab = realloc(ble_pkt_slab, size * sizeof(ble_pkt_t*))) == NULL )
+        return NULL;
+
+      ble_pkt_slab = slab;
+      ble_pkt_slab_size = size;
+    }
+
+    if ( (ble_pkt_slab[chunk] = malloc(BLE_PKT_SLAB_CHUNK * sizeof(ble_pkt_t))) == NULL )
+      return NULL;
+  }
+
+  id = ble_pkt_num++;
+  pkt = ble_pkt_get(id);
+
+ble_pkt_alloc_init:
+
+  memset(pkt, 0, sizeof(ble_pkt_t));
+  pkt->id = id;
+  ble_pkt_live++;
+
+  if ( advinfo_len ) {
+
+    if ( (pkt->data.advinfo = ble_pkt_side_alloc(advinfo_len)) == NULL )
+      return NULL;
+
+    pkt->side = 1;
+  }
+
+return pkt;
+}
+
+// Return record and its advertising data for reuse
+void ble_pkt_release( ble_pkt_t *pkt ) {
+
+  if ( pkt->side )
+    ble_pkt_side_release(pkt->data.advinfo, sizeof(le_advertising_info) + pkt->data.advinfo->length);
+
+  pkt->recv_us = ble_pkt_free_id;
+  ble_pkt_free_id = pkt->id;
+  ble_pkt_live--;
+}
+
+// Memory used by live packets
+size_t ble_pkt_mem() {
+  return (size_t)ble_pkt_live * sizeof(ble_pkt_t) + ble_pkt_side_used;
+}
+
+// Release all packets at once
+void ble_pkt_arena_free() {
+
+  for ( uint32_t c = 0 ; c < (ble_pkt_num + BLE_PKT_SLAB_CHUNK - 1) >> BLE_PKT_SLAB_SHIFT ; c++ )
+    free(ble_pkt_slab[c]);
+
+  free(ble_pkt_slab);
+
+  ble_pkt_slab = NULL;
+  ble_pkt_slab_size = 0;
+  ble_pkt_num = 0;
+  ble_pkt_live = 0;
+  ble_pkt_free_id = UINT32_MAX;
+
+  ble_pkt_arena_release(&ble_pkt_side);
+  memset(ble_pkt_side_free, 0, sizeof(ble_pkt_side_free));
+  ble_pkt_side_used = 0;
+}
+
 void ble_ga_adv_print( ble_ga_adv_t *en ) {
 
   if ( !en ) return;
@@ -22,7 +193,7 @@ void ble_pkt_print( ble_pkt_t *pkt, int print_datadump ) {
 
   if ( !pkt ) return;
 
-  print_tv( &pkt->recv_time );
+  print_usec( pkt->recv_us );
 
   char addr[18];
   ba2str(&(pkt->bda), addr);
@@ -39,67 +210,50 @@ void ble_pkt_print( ble_pkt_t *pkt, int print_datadump ) {
       }
     break;
     case BLE_GA_EN:
-      ble_ga_adv_print(pkt->data.ga);
+      ble_ga_adv_print(&pkt->data.ga);
 
       if ( print_datadump ) {
         printf("\n");
-        hexdump((uint8_t*)pkt->data.ga, sizeof(ble_ga_adv_t) );
+        hexdump((uint8_t*)&pkt->data.ga, sizeof(ble_ga_adv_t) );
       }
     break;
   }
 }
 
-void ble_pkt_free( ble_pkt_t *pkt ) {
-
-  switch (pkt->data_type) {
-    case BLE_ADV_INFO:
-      if ( pkt->data.advinfo ) free(pkt->data.advinfo);
-    break;
-    case BLE_GA_EN:
-      if ( pkt->data.ga ) free(pkt->data.ga);
-    break;
-  }
-
-  free(pkt);
-
-}
-
-ble_pkt_t* ble_info2pkt( le_advertising_info *info ) {
+ble_pkt_t* ble_info2pkt( le_advertising_info *info, uint64_t recv_us ) {
 
   ble_pkt_t *pkt = NULL;
 
-  if ( (pkt = calloc(1, sizeof(ble_pkt_t) )) == NULL ) {
-    goto ble_info2pkt_enomem;
-  }
-
-  gettimeofday(&pkt->recv_time, NULL);
-
   // is it EN G+A service?
   if ( memcmp(info->data, "\x03\x03\x6f\xfd", 4) ) {
-    pkt->data_type = BLE_ADV_INFO;
 
-    if ( (pkt->data.advinfo = (le_advertising_info*) malloc(sizeof(le_advertising_info) + info->length)) == NULL ) {
+    if ( (pkt = ble_pkt_alloc(sizeof(le_advertising_info) + info->length)) == NULL ) {
       goto ble_info2pkt_enomem;
     }
 
+    pkt->data_type = BLE_ADV_INFO;
+
     memcpy(pkt->data.advinfo, info, sizeof(le_advertising_info) );
     memcpy(pkt->data.advinfo->data, info->data, info->length );
 
   } else {
-    pkt->data_type = BLE_GA_EN;
 
-    if ( (pkt->data.ga = (ble_ga_adv_t*) malloc(sizeof(ble_ga_adv_t))) == NULL ) {
+    if ( (pkt = ble_pkt_alloc(0)) == NULL ) {
       goto ble_info2pkt_enomem;
     }
 
+    pkt->data_type = BLE_GA_EN;
+
     ble_ga_adv_t *ga_info = (ble_ga_adv_t *) (info->data + 4);
 
-    memcpy(pkt->data.ga, ga_info, sizeof(ble_ga_adv_t) );
+    memcpy(&pkt->data.ga, ga_info, sizeof(ble_ga_adv_t) );
 
-    pkt->data.ga->uuid = btohs(ga_info->uuid);
+    pkt->data.ga.uuid = btohs(ga_info->uuid);
 
   }
 
+  pkt->recv_us = recv_us;
+
   pkt->bdaddr_type = info->bdaddr_type;
   bacpy(&pkt->bda, &info->bdaddr);
   pkt->rssi = (int8_t) ( *(info->data + info->length) );
@@ -111,4 +265,3 @@ ble_info2pkt_enomem:
   perror("Could not allocate packet");
   exit(ENOMEM);
 }
-
@@ -30,30 +30,77 @@ typedef enum {
 
 } ble_pkt_data_type;
 
+// Compact packet record, 48 bytes. GA data is stored inline,
+// other advertising data goes to side buffer.
 typedef struct ble_pkt_s {
 
-  struct ble_pkt_s *older;  // packet received before that packet
-  struct ble_pkt_s *newer;  // packet received after that packet
+  uint64_t recv_us;         // receive time in usec since epoch
+
+  uint32_t id;              // index in packet slab
 
-  uint8_t bdaddr_type;
   bdaddr_t bda;
-  int rssi;
-  struct timeval recv_time;
+  int8_t rssi;
+
+  // type tag
+  uint8_t bdaddr_type:3;
+  uint8_t side:1;           // advinfo is allocated in side buffer
+  uint8_t evicted:1;        // dropped from stream, kept only as its first or last GA packet
+  uint8_t data_type:3;      // ble_pkt_data_type
 
-  ble_pkt_data_type data_type;
+  uint8_t src;              // capture source (adapter) index
 
-  union {
-    ble_ga_adv_t *ga;
+  union __attribute__ ((packed)) {
+    ble_ga_adv_t ga;
     le_advertising_info *advinfo;
-//    uint8_t raw[255];
   } data;
 
 } ble_pkt_t;
 
+// Packets are never released one by one, so records are kept in
+// a slab of big chunks, and addressed by 32bit index
+#define BLE_PKT_SLAB_SHIFT 14
+#define BLE_PKT_SLAB_CHUNK (1 << BLE_PKT_SLAB_SHIFT)  // records per chunk
+
+extern ble_pkt_t **ble_pkt_slab;
+
+static inline ble_pkt_t* ble_pkt_get( uint32_t id ) {
+  return &ble_pkt_slab[id >> BLE_PKT_SLAB_SHIFT][id & (BLE_PKT_SLAB_CHUNK - 1)];
+}
+
+// Side buffer for advertising data of not EN packets
+#define BLE_PKT_ARENA_CHUNK (1 << 20)
+
+typedef struct ble_pkt_chunk_s {
+
+  struct ble_pkt_chunk_s *next;
+
+  size_t size;
+  size_t used;
+
+  uint8_t data[];
+
+} ble_pkt_chunk_t;
+
+// Released side buffer blocks are reused by blocks of the same size
+#define BLE_PKT_SIDE_BUCKETS 256   // 8 byte steps
+
+ble_pkt_t* ble_pkt_alloc( size_t advinfo_len );
+void ble_pkt_release( ble_pkt_t *pkt );
+void ble_pkt_arena_free();
+size_t ble_pkt_mem();
+
+// Copy receive time, address and RSSI
+static inline void ble_pkt_copy_hdr( ble_pkt_t *pkt, ble_pkt_t *src ) {
+  pkt->recv_us = src->recv_us;
+  bacpy(&pkt->bda, &src->bda);
+  pkt->rssi = src->rssi;
+  pkt->bdaddr_type = src->bdaddr_type;
+  pkt->src = src->src;
+}
+
 void ble_ga_adv_print( ble_ga_adv_t *en );
 void ble_pkt_print( ble_pkt_t *pkt, int print_datadump );
-void ble_pkt_free( ble_pkt_t *pkt );
 
-ble_pkt_t* ble_info2pkt( le_advertising_info *info );
+ble_pkt_t* ble_info2pkt( le_advertising_info *info, uint64_t recv_us );
 
 #endif // __BLE_ADV_H__
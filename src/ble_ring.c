@@ -0,0 +1,116 @@
+/*
+ *
+ * Adrian Brzezinski (2020) <adrian.brzezinski at adrb.pl>
+ * License: GPLv2+
+ *
+ */
+
+#include <poll.h>
+#include <sys/eventfd.h>
+
+#include "bentool.h"
+
+int ble_ring_init( ble_ring_t *ring, uint32_t slots ) {
+
+  memset(ring, 0, sizeof(ble_ring_t));
+
+  if ( !slots || (slots & (slots - 1)) ) return -1;
+
+  if ( (ring->slots = malloc(slots * sizeof(ble_ring_slot_t))) == NULL ) {
+    perror("Could not allocate ring");
+    exit(ENOMEM);
+  }
+
+  if ( (ring->efd = eventfd(0, EFD_CLOEXEC)) < 0 ) {
+    perror("Could not create eventfd");
+    free(ring->slots);
+    return -1;
+  }
+
+  ring->mask = slots - 1;
+  atomic_init(&ring->head, 0);
+  atomic_init(&ring->tail, 0);
+
+return 0;
+}
+
+void ble_ring_free( ble_ring_t *ring ) {
+
+  if ( ring->efd > 0 ) close(ring->efd);
+  free(ring->slots);
+
+  memset(ring, 0, sizeof(ble_ring_t));
+}
+
+// Producer: slot to fill, NULL if ring is full
+ble_ring_slot_t* ble_ring_reserve( ble_ring_t *ring ) {
+
+  uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+  if ( head - tail > ring->mask ) return NULL;
+
+return &ring->slots[head & ring->mask];
+}
+
+// Producer: publish reserved slot
+void ble_ring_commit( ble_ring_t *ring ) {
+
+  uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed) + 1;
+  uint32_t used = head - atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+  atomic_store_explicit(&ring->head, head, memory_order_release);
+
+  ring->pushed++;
+  if ( used > ring->high_water ) ring->high_water = used;
+}
+
+void ble_ring_drop( ble_ring_t *ring ) {
+  ring->dropped++;
+}
+
+// Producer: wake consumer, once per batch of commits
+void ble_ring_notify( ble_ring_t *ring ) {
+
+  uint64_t one = 1;
+
+  if ( write(ring->efd, &one, sizeof(one)) < 0 )
+    perror("Ring notify failed");
+}
+
+// Consumer: oldest slot, NULL if ring is empty
+ble_ring_slot_t* ble_ring_peek( ble_ring_t *ring ) {
+
+  uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+  if ( tail == atomic_load_explicit(&ring->head, memory_order_acquire) ) return NULL;
+
+return &ring->slots[tail & ring->mask];
+}
+
+void ble_ring_pop( ble_ring_t *ring ) {
+
+  uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+  atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+}
+
+// Consumer of several rings: sleep until any producer notifies,
+// timeout in ms, -1 waits forever
+void ble_ring_wait( ble_ring_t **rings, int num, int timeout_ms ) {
+
+  struct pollfd pfd[num];
+  uint64_t cnt;
+  int i;
+
+  for ( i = 0 ; i < num ; i++ ) {
+    pfd[i].fd = rings[i]->efd;
+    pfd[i].events = POLLIN;
+  }
+
+  if ( poll(pfd, num, timeout_ms) <= 0 ) return;
+
+  for ( i = 0 ; i < num ; i++ )
+    if ( pfd[i].revents & POLLIN )
+      while ( read(rings[i]->efd, &cnt, sizeof(cnt)) < 0 && errno == EINTR );
+}
@@ -0,0 +1,60 @@
+/*
+ *
+ * Adrian Brzezinski (2020) <adrian.brzezinski at adrb.pl>
+ * License: GPLv2+
+ *
+ */
+
+#ifndef __BLE_RING_H__
+#define __BLE_RING_H__
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+
+// Single producer, single consumer ring of raw HCI events. Capture thread
+// reads events straight into reserved slots, ingest thread parses them.
+// Consumer sleeps on eventfd when ring is empty, it can wait for
+// several rings at once.
+#define BLE_RING_SLOTS 8192   // power of 2
+
+typedef struct {
+
+  uint64_t recv_us;
+  uint64_t queued_ns;   // monotonic time of commit, set by replay
+  uint16_t len;
+  uint8_t src;          // capture source index
+  uint8_t data[HCI_MAX_EVENT_SIZE];
+
+} ble_ring_slot_t;
+
+typedef struct {
+
+  _Alignas(64) atomic_uint head;    // next slot to fill, written by producer
+  _Alignas(64) atomic_uint tail;    // next slot to read, written by consumer
+
+  _Alignas(64) ble_ring_slot_t *slots;
+  uint32_t mask;
+  int efd;
+
+  // producer side counters
+  uint32_t high_water;  // max slots in use
+  uint64_t pushed;
+  uint64_t dropped;     // events lost because ring was full
+
+} ble_ring_t;
+
+int ble_ring_init( ble_ring_t *ring, uint32_t slots );
+void ble_ring_free( ble_ring_t *ring );
+
+ble_ring_slot_t* ble_ring_reserve( ble_ring_t *ring );
+void ble_ring_commit( ble_ring_t *ring );
+void ble_ring_drop( ble_ring_t *ring );
+void ble_ring_notify( ble_ring_t *ring );
+
+ble_ring_slot_t* ble_ring_peek( ble_ring_t *ring );
+void ble_ring_pop( ble_ring_t *ring );
+void ble_ring_wait( ble_ring_t **rings, int num, int timeout_ms );
+
+#endif // __BLE_RING_H__
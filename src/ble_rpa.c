@@ -0,0 +1,403 @@
+/*
+ *
+ * Adrian Brzezinski (2020) <adrian.brzezinski at adrb.pl>
+ * License: GPLv2+
+ *
+ * Batch RPA resolution. Single AES block per IRK check is latency bound,
+ * so we keep BLE_RPA_LANES independent blocks in flight instead:
+ *  - one address against many IRKs - AES-NI with interleaved key schedules
+ *  - many addresses against one IRK - ECB through EVP, which uses AES-NI
+ *    pipelining by itself
+ * Without AES-NI both fall back to OpenSSL portable code.
+ */
+
+#include "bentool.h"
+
+#include <openssl/rand.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BLE_RPA_X86
+#endif
+
+ble_rpa_keyset_t ble_rpa_bonded;
+
+// Addresses already resolved against bonded IRKs, device keeps the same RPA
+// for ~15min, so we resolve each of them only once
+ble_idx_t ble_rpa_cache = { .key_len = sizeof(bdaddr_t) };
+static ble_bonding_t ble_rpa_cache_none;    // resolved, but not bonded
+
+int ble_rpa_aesni() {
+
+#ifdef BLE_RPA_X86
+  static int aesni = -1;
+
+  if ( aesni < 0 )
+    aesni = __builtin_cpu_supports("aes");
+
+return aesni;
+#else
+return 0;
+#endif
+}
+
+// Set plaintext block and expected hash for address, BT Core 5.0 Vol 3 Part H, 2.2.2
+static inline int ble_rpa_block( bdaddr_t *bda, uint8_t in[16], uint8_t hash[3] ) {
+
+  if ( !bda || (bda->b[5]&0xc0) != 0x40 )  // is it resolvable device address?
+    return 1;
+
+  memset(in, 0, 16);
+  in[13] = bda->b[5];
+  in[14] = bda->b[4];
+  in[15] = bda->b[3];
+
+  hash[0] = bda->b[2];
+  hash[1] = bda->b[1];
+  hash[2] = bda->b[0];
+
+return 0;
+}
+
+#ifdef BLE_RPA_X86
+
+__attribute__((target("aes,sse2")))
+static inline __m128i ble_rpa_expand_step( __m128i key, __m128i assist ) {
+
+  assist = _mm_shuffle_epi32(assist, 0xff);
+  key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+  key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+  key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+
+return _mm_xor_si128(key, assist);
+}
+
+#define BLE_RPA_EXPAND(rk, i, rcon) \
+  rk[i] = ble_rpa_expand_step(rk[i-1], _mm_aeskeygenassist_si128(rk[i-1], rcon))
+
+__attribute__((target("aes,sse2")))
+static void ble_rpa_expand_aesni( const uint8_t irk[16], uint8_t *out ) {
+
+  __m128i rk[11];
+
+  rk[0] = _mm_loadu_si128((const __m128i*)irk);
+  BLE_RPA_EXPAND(rk, 1, 0x01);
+  BLE_RPA_EXPAND(rk, 2, 0x02);
+  BLE_RPA_EXPAND(rk, 3, 0x04);
+  BLE_RPA_EXPAND(rk, 4, 0x08);
+  BLE_RPA_EXPAND(rk, 5, 0x10);
+  BLE_RPA_EXPAND(rk, 6, 0x20);
+  BLE_RPA_EXPAND(rk, 7, 0x40);
+  BLE_RPA_EXPAND(rk, 8, 0x80);
+  BLE_RPA_EXPAND(rk, 9, 0x1b);
+  BLE_RPA_EXPAND(rk, 10, 0x36);
+
+  for ( int i = 0 ; i < 11 ; i++ )
+    _mm_store_si128((__m128i*)(out + (i << 4)), rk[i]);
+}
+
+// Encrypt the same block with BLE_RPA_LANES keys at once, so AES rounds
+// of independent keys overlap in the pipeline
+__attribute__((target("aes,sse2")))
+static int ble_rpa_resolve_aesni( ble_rpa_keyset_t *ks, uint8_t in[16], uint8_t hash[3] ) {
+
+  __m128i s[BLE_RPA_LANES], block, want, mask;
+  uint8_t want_b[16];
+  int i, l, lanes;
+
+  memset(want_b, 0, 16);
+  memcpy(want_b + 13, hash, 3);
+
+  block = _mm_loadu_si128((__m128i*)in);
+  want = _mm_loadu_si128((__m128i*)want_b);
+
+  for ( i = 0 ; i < ks->num ; i += BLE_RPA_LANES ) {
+
+    const __m128i *rk = (const __m128i*)(ks->rk + i * BLE_RPA_RK_SIZE);
+
+    lanes = ks->num - i < BLE_RPA_LANES ? ks->num - i : BLE_RPA_LANES;
+
+    for ( l = 0 ; l < lanes ; l++ )
+      s[l] = _mm_xor_si128(block, rk[l*11]);
+
+    for ( int r = 1 ; r < 10 ; r++ )
+      for ( l = 0 ; l < lanes ; l++ )
+        s[l] = _mm_aesenc_si128(s[l], rk[l*11 + r]);
+
+    for ( l = 0 ; l < lanes ; l++ ) {
+
+      s[l] = _mm_aesenclast_si128(s[l], rk[l*11 + 10]);
+
+      // compare last 3 bytes with hash
+      mask = _mm_cmpeq_epi8(s[l], want);
+      if ( (_mm_movemask_epi8(mask) & 0xe000) == 0xe000 )
+        return i + l;
+    }
+  }
+
+return -1;
+}
+
+#endif // BLE_RPA_X86
+
+// Prepare IRKs of bonding list for batch resolution, bondings without key are skipped
+int ble_rpa_keyset_init( ble_rpa_keyset_t *ks, ble_bonding_t *bk_list ) {
+
+  ble_bonding_t *bk;
+  int num;
+
+  if ( !ks ) return -1;
+
+  memset(ks, 0, sizeof(ble_rpa_keyset_t));
+
+  for ( num = 0, bk = bk_list ; bk ; bk = bk->next )
+    if ( bk->has_irk ) num++;
+
+  if ( !num ) return 0;
+
+  if ( (ks->bk = calloc(num, sizeof(ble_bonding_t*))) == NULL ||
+       posix_memalign((void**)&ks->rk, 16, num * BLE_RPA_RK_SIZE) ) {
+    perror("Could not allocate IRK keyset");
+    exit(ENOMEM);
+  }
+
+  for ( bk = bk_list ; bk ; bk = bk->next ) {
+
+    if ( !bk->has_irk ) continue;
+
+#ifdef BLE_RPA_X86
+    if ( ble_rpa_aesni() )
+      ble_rpa_expand_aesni(bk->irk, ks->rk + ks->num * BLE_RPA_RK_SIZE);
+#endif
+
+    ks->bk[ks->num++] = bk;
+  }
+
+return 0;
+}
+
+void ble_rpa_keyset_free( ble_rpa_keyset_t *ks ) {
+
+  if ( !ks ) return;
+
+  free(ks->bk);
+  free(ks->rk);
+
+  memset(ks, 0, sizeof(ble_rpa_keyset_t));
+}
+
+// Check one prand against all IRKs in keyset
+int ble_rpa_keyset_resolve( ble_rpa_keyset_t *ks, bdaddr_t *bda ) {
+
+  uint8_t in[16], out[16], hash[3];
+
+  if ( !ks->num || ble_rpa_block(bda, in, hash) )
+    return -1;
+
+#ifdef BLE_RPA_X86
+  if ( ble_rpa_aesni() )
+    return ble_rpa_resolve_aesni(ks, in, hash);
+#endif
+
+  for ( int i = 0 ; i < ks->num ; i++ ) {
+
+    AES_encrypt(in, out, &ks->bk[i]->aes_ekey);
+
+    if ( !memcmp(out + 13, hash, 3) )
+      return i;
+  }
+
+return -1;
+}
+
+// Rebuild bonded keyset, call it every time bonding set changes
+void ble_rpa_bonded_update( ble_bonding_t *bk_list ) {
+
+  ble_rpa_keyset_free(&ble_rpa_bonded);
+  ble_rpa_keyset_init(&ble_rpa_bonded, bk_list);
+
+  ble_idx_free(&ble_rpa_cache);
+}
+
+ble_bonding_t *ble_rpa_resolve_bonded( bdaddr_t *bda ) {
+
+  ble_bonding_t *bk;
+  int i;
+
+  if ( !ble_rpa_bonded.num || !bda || (bda->b[5]&0xc0) != 0x40 )
+    return NULL;
+
+  if ( (bk = ble_idx_get(&ble_rpa_cache, bda)) )
+    return bk == &ble_rpa_cache_none ? NULL : bk;
+
+  i = ble_rpa_keyset_resolve(&ble_rpa_bonded, bda);
+  bk = i < 0 ? NULL : ble_rpa_bonded.bk[i];
+
+  // keep cache bounded, just start over when it's full
+  if ( ble_rpa_cache.used >= BLE_RPA_CACHE_MAX )
+    ble_idx_free(&ble_rpa_cache);
+
+  ble_idx_set(&ble_rpa_cache, bda, bk ? bk : &ble_rpa_cache_none);
+
+return bk;
+}
+
+// Check many addresses against one IRK, blocks are encrypted in bulk as ECB
+int ble_rpa_resolve_many( bdaddr_t *bda, int num, ble_bonding_t *bk, uint8_t *resolved ) {
+
+  uint8_t in[BLE_RPA_LANES * 32 * 16], out[sizeof(in) + 16], hash[BLE_RPA_LANES * 32][3];
+  int idx[BLE_RPA_LANES * 32];
+  int i, n, outl, ret = 0;
+  EVP_CIPHER_CTX *ctx;
+
+  if ( !bda || !bk || !resolved || !bk->has_irk ) return -1;
+
+  memset(resolved, 0, num);
+
+  if ( (ctx = EVP_CIPHER_CTX_new()) == NULL ||
+       !EVP_EncryptInit_ex(ctx, EVP_aes_128_ecb(), NULL, bk->irk, NULL) ) {
+    EVP_CIPHER_CTX_free(ctx);
+    return -1;
+  }
+
+  EVP_CIPHER_CTX_set_padding(ctx, 0);
+
+  for ( i = 0 ; i < num ; ) {
+
+    // gather resolvable addresses
+    for ( n = 0 ; i < num && n < sizeof(idx)/sizeof(idx[0]) ; i++ ) {
+
+      if ( ble_rpa_block(&bda[i], in + (n << 4), hash[n]) ) continue;
+
+      idx[n++] = i;
+    }
+
+    if ( !n ) break;
+
+    if ( !EVP_EncryptUpdate(ctx, out, &outl, in, n << 4) ) {
+      ret = -1;
+      break;
+    }
+
+    for ( int b = 0 ; b < n ; b++ ) {
+
+      if ( memcmp(out + (b << 4) + 13, hash[b], 3) ) continue;
+
+      resolved[idx[b]] = 1;
+      ret++;
+    }
+  }
+
+  EVP_CIPHER_CTX_free(ctx);
+
+return ret;
+}
+
+static double ble_rpa_bench_now() {
+
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+// Compare resolutions per second of single key, cached key and batch paths
+void ble_rpa_bench( int iterations ) {
+
+  int irks_num[] = { 1, 64, 4096 };
+  int addrs_num = 4096;
+  ble_bonding_t *bks, *bk;
+  ble_rpa_keyset_t ks;
+  bdaddr_t *addrs;
+  uint8_t *resolved;
+  volatile int hits;
+  double start, elapsed;
+  long checks;
+
+  if ( iterations < 1 ) iterations = 1;
+
+  if ( (bks = calloc(irks_num[2], sizeof(ble_bonding_t))) == NULL ||
+       (addrs = calloc(addrs_num, sizeof(bdaddr_t))) == NULL ||
+       (resolved = calloc(addrs_num, 1)) == NULL ) {
+    perror("Could not allocate benchmark data");
+    exit(ENOMEM);
+  }
+
+  RAND_bytes((void*)addrs, addrs_num * sizeof(bdaddr_t));
+  for ( int a = 0 ; a < addrs_num ; a++ )
+    addrs[a].b[5] = (addrs[a].b[5] & 0x3f) | 0x40;
+
+  for ( int k = 0 ; k < irks_num[2] ; k++ ) {
+    RAND_bytes(bks[k].irk, 16);
+    bks[k].has_irk = 1;
+    AES_set_encrypt_key(bks[k].irk, 128, &bks[k].aes_ekey);
+  }
+
+  printf("AES-NI: %s\n", ble_rpa_aesni() ? "yes" : "no");
+  printf("%-6s %-14s %16s\n", "IRKs", "method", "resolutions/s");
+
+  for ( int t = 0 ; t < sizeof(irks_num)/sizeof(irks_num[0]) ; t++ ) {
+
+    int num = irks_num[t];
+    int addrs_used = addrs_num / num > 0 ? addrs_num / num : 1;   // keep work per test similar
+
+    for ( int k = 0 ; k < num ; k++ )
+      bks[k].next = k + 1 < num ? &bks[k+1] : NULL;
+
+    ble_rpa_keyset_init(&ks, bks);
+
+    checks = (long)iterations * addrs_used * num;
+
+    // the way it was done so far, key schedule on every call
+    hits = 0;
+    start = ble_rpa_bench_now();
+    for ( int it = 0 ; it < iterations ; it++ )
+      for ( int a = 0 ; a < addrs_used ; a++ )
+        for ( bk = bks ; bk ; bk = bk->next )
+          hits += !ble_resolve_rpa(&addrs[a], bk->irk);
+    elapsed = ble_rpa_bench_now() - start;
+    printf("%-6d %-14s %16.0f\n", num, "ble_resolve_rpa", checks / elapsed);
+
+    hits = 0;
+    start = ble_rpa_bench_now();
+    for ( int it = 0 ; it < iterations ; it++ )
+      for ( int a = 0 ; a < addrs_used ; a++ )
+        for ( bk = bks ; bk ; bk = bk->next )
+          hits += !ble_resolve_rpa_key(&addrs[a], &bk->aes_ekey);
+    elapsed = ble_rpa_bench_now() - start;
+    printf("%-6d %-14s %16.0f\n", num, "cached key", checks / elapsed);
+
+    hits = 0;
+    start = ble_rpa_bench_now();
+    for ( int it = 0 ; it < iterations ; it++ )
+      for ( int a = 0 ; a < addrs_used ; a++ )
+        hits += ble_rpa_keyset_resolve(&ks, &addrs[a]) >= 0;
+    elapsed = ble_rpa_bench_now() - start;
+    printf("%-6d %-14s %16.0f\n", num, "batch IRKs", checks / elapsed);
+
+    ble_rpa_keyset_free(&ks);
+  }
+
+  // many addresses against single IRK
+  bks[0].next = NULL;
+  checks = (long)iterations * addrs_num;
+
+  hits = 0;
+  start = ble_rpa_bench_now();
+  for ( int it = 0 ; it < iterations ; it++ )
+    for ( int a = 0 ; a < addrs_num ; a++ )
+      hits += !ble_resolve_rpa(&addrs[a], bks[0].irk);
+  elapsed = ble_rpa_bench_now() - start;
+  printf("%-6d %-14s %16.0f (%d addresses)\n", 1, "ble_resolve_rpa", checks / elapsed, addrs_num);
+
+  start = ble_rpa_bench_now();
+  for ( int it = 0 ; it < iterations ; it++ )
+    hits = ble_rpa_resolve_many(addrs, addrs_num, &bks[0], resolved);
+  elapsed = ble_rpa_bench_now() - start;
+  printf("%-6d %-14s %16.0f (%d addresses)\n", 1, "batch addrs", checks / elapsed, addrs_num);
+
+  free(resolved);
+  free(addrs);
+  free(bks);
+}
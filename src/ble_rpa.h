@@ -0,0 +1,43 @@
+/*
+ *
+ * Adrian Brzezinski (2020) <adrian.brzezinski at adrb.pl>
+ * License: GPLv2+
+ *
+ */
+
+#ifndef __BLE_RPA_H__
+#define __BLE_RPA_H__
+
+#include <bluetooth/bluetooth.h>
+
+#include "ble_stream.h"
+
+#define BLE_RPA_LANES 8         // AES blocks in flight
+#define BLE_RPA_RK_SIZE 176     // AES-128 expanded key, 11 round keys
+#define BLE_RPA_CACHE_MAX 65536 // resolved addresses remembered
+
+// Bonded IRKs prepared for batch resolution
+typedef struct {
+
+  int num;
+  ble_bonding_t **bk;
+  uint8_t *rk;            // AES-NI round keys, BLE_RPA_RK_SIZE per IRK
+
+} ble_rpa_keyset_t;
+
+extern ble_rpa_keyset_t ble_rpa_bonded;
+
+int ble_rpa_aesni();
+
+int ble_rpa_keyset_init( ble_rpa_keyset_t *ks, ble_bonding_t *bk_list );
+void ble_rpa_keyset_free( ble_rpa_keyset_t *ks );
+
+int ble_rpa_keyset_resolve( ble_rpa_keyset_t *ks, bdaddr_t *bda );   // returns index of matching IRK or -1
+
+void ble_rpa_bonded_update( ble_bonding_t *bk_list );
+ble_bonding_t *ble_rpa_resolve_bonded( bdaddr_t *bda );
+int ble_rpa_resolve_many( bdaddr_t *bda, int num, ble_bonding_t *bk, uint8_t *resolved );  // returns resolved count
+
+void ble_rpa_bench( int iterations );
+
+#endif // __BLE_RPA_H__
@@ -0,0 +1,241 @@
+/*
+ *
+ * Adrian Brzezinski (2020) <adrian.brzezinski at adrb.pl>
+ * License: GPLv2+
+ *
+ */
+
+#include "bentool.h"
+
+le_advertising_info* ble_batch_report( ble_batch_t *b, uint64_t recv_us, uint8_t src, uint8_t length ) {
+
+  le_advertising_info *info;
+  size_t size = sizeof(le_advertising_info) + length + 1;
+
+  if ( !ble_batch_room(b, 1, size) ) return NULL;
+
+  info = (le_advertising_info*)(b->buf + b->used);
+  info->length = length;
+
+  b->reps[b->num].recv_us = recv_us;
+  b->reps[b->num].info = info;
+  b->reps[b->num].src = src;
+
+  b->num++;
+  b->used += size;
+
+return info;
+}
+
+le_advertising_info* ble_batch_adv( ble_batch_t *b, uint64_t recv_us, uint8_t src,
+    le_advertising_info *info, int8_t rssi ) {
+
+  le_advertising_info *rep;
+
+  if ( (rep = ble_batch_report(b, recv_us, src, info->length)) == NULL ) return NULL;
+
+  memcpy(rep, info, sizeof(le_advertising_info) + info->length);
+  rep->data[rep->length] = rssi;
+
+return rep;
+}
+
+// Rebuild EN advertisement: 16bit service UUID list and service data
+le_advertising_info* ble_batch_en( ble_batch_t *b, uint64_t recv_us, uint8_t src,
+    bdaddr_t *bda, uint8_t bdaddr_type, ble_ga_adv_t *ga, int8_t rssi ) {
+
+  le_advertising_info *rep;
+  ble_ga_adv_t *data;
+
+  if ( (rep = ble_batch_report(b, recv_us, src, 4 + sizeof(ble_ga_adv_t))) == NULL ) return NULL;
+
+  rep->evt_type = 0x03;   // ADV_NONCONN_IND
+  rep->bdaddr_type = bdaddr_type;
+  bacpy(&rep->bdaddr, bda);
+
+  memcpy(rep->data, "\x03\x03\x6f\xfd", 4);
+
+  data = (ble_ga_adv_t*)(rep->data + 4);
+  memcpy(data, ga, sizeof(ble_ga_adv_t));
+  data->uuid = htobs(ga->uuid);
+
+  rep->data[rep->length] = rssi;
+
+return rep;
+}
+
+int ble_source_next( ble_source_t *s, ble_batch_t *batch ) {
+
+  batch->num = 0;
+  batch->used = 0;
+
+return s->ops->next(s, batch);
+}
+
+void ble_source_close( ble_source_t *s ) {
+
+  if ( s->ops && s->ops->close )
+    s->ops->close(s);
+
+  s->ops = NULL;
+  s->priv = NULL;
+}
+
+// Report becomes packet of stream, then goes to capture file and output
+int ble_ingest_report( ble_ingest_t *ing, ble_report_t *rep ) {
+
+  ble_stage_stats_t *st = ing->stages;
+  ble_pkt_t *pkt;
+  uint64_t t0 = 0, t1;
+
+  if ( st ) t0 = mono_nsec();
+
+  if ( (pkt = ble_info2pkt(rep->info, rep->recv_us)) == NULL )
+    return -1;
+
+  pkt->src = rep->src;
+
+  if ( ing->verbose ) {
+    ble_pkt_print(pkt, 0);
+    printf("\n");
+  }
+
+  if ( st ) {
+    t1 = mono_nsec();
+    ble_stage_add(st, BLE_STAGE_PKT, t1 - t0);
+    t0 = t1;
+  }
+
+  if ( ble_stream_pkt_add(pkt) < 0 )
+    return -1;
+
+  if ( st ) {
+    t1 = mono_nsec();
+    ble_stage_add(st, BLE_STAGE_STREAM, t1 - t0);
+    t0 = t1;
+  }
+
+  ble_cap_writer_add(ing->capw, pkt);
+  if ( ing->out ) ble_out_add(ing->out, pkt);
+
+  if ( st ) ble_stage_add(st, BLE_STAGE_OUTPUT, mono_nsec() - t0);
+
+  if ( !ing->pkts++ ) ing->first_us = pkt->recv_us;
+  ing->last_us = pkt->recv_us;
+
+return 0;
+}
+
+// Ingest until source ends
+int ble_ingest( ble_source_t *s, ble_ingest_t *ing ) {
+
+  ble_batch_t *batch;
+  int num, i;
+
+  if ( (batch = malloc(sizeof(ble_batch_t))) == NULL ) {
+    perror("Could not allocate report batch");
+    exit(ENOMEM);
+  }
+
+  while ( (num = ble_source_next(s, batch)) > 0 ) {
+
+    for ( i = 0 ; i < num ; i++ )
+      if ( ble_ingest_report(ing, &batch->reps[i]) < 0 )
+        break;
+
+    if ( i < num ) {
+      num = -1;
+      break;
+    }
+  }
+
+  free(batch);
+
+return num < 0 ? -1 : 0;
+}
+
+int ble_source_load( ble_source_t *s, int verbose ) {
+
+  ble_ingest_t ing;
+  int ret;
+
+  memset(&ing, 0, sizeof(ing));
+  ing.verbose = verbose;
+
+  ble_stream_free();
+
+  ret = ble_ingest(s, &ing);
+  ble_source_close(s);
+
+  printf("Loaded %lu packets", (unsigned long)ing.pkts);
+  if ( ing.pkts ) {
+    printf(", ");
+    print_usec(ing.first_us);
+    printf(" - ");
+    print_usec(ing.last_us);
+  }
+  printf("\n");
+
+return ret;
+}
+
+// Ingest whole source into empty streams and measure rate
+int ble_source_bench( ble_source_t *s ) {
+
+  ble_ingest_t ing;
+  ble_pkt_stream_t *bps;
+  const char *name = s->ops->name;
+  uint64_t start, elapsed, streams = 0;
+  int ret;
+
+  memset(&ing, 0, sizeof(ing));
+
+  ble_stream_free();
+
+  start = mono_usec();
+  ret = ble_ingest(s, &ing);
+  elapsed = mono_usec() - start;
+
+  ble_source_close(s);
+
+  for ( bps = ble_stream ; bps ; bps = bps->next )
+    streams++;
+
+  if ( !elapsed ) elapsed = 1;
+
+  printf("Ingested %lu reports from %s in %.3f s, %.0f reports/s, %lu streams, %lu KB of packets\n",
+    (unsigned long)ing.pkts, name, elapsed / 1000000.0, ing.pkts * 1000000.0 / elapsed,
+    (unsigned long)streams, (unsigned long)(ble_pkt_mem() >> 10));
+
+return ret;
+}
+
+// Upper bound of bucket holding given share of samples
+static uint64_t ble_stage_pct( ble_stage_stats_t *st, ble_stage stage, double pct ) {
+
+  uint64_t want = st->num[stage] * pct, seen = 0, ns;
+  int b;
+
+  for ( b = 0 ; b < BLE_STAGE_BUCKETS - 1 ; b++ )
+    if ( (seen += st->hist[stage][b]) > want ) break;
+
+  ns = b ? (1ULL << b) - 1 : 0;
+
+return ns < st->max_ns[stage] ? ns : st->max_ns[stage];
+}
+
+void ble_stage_print( ble_stage_stats_t *st ) {
+
+  const char *names[BLE_STAGES] = { "queue", "parse", "packet", "stream", "output" };
+
+  printf("%-8s %12s %10s %10s %10s %10s\n", "STAGE", "COUNT", "AVG ns", "P50 ns", "P99 ns", "MAX ns");
+
+  for ( int i = 0 ; i < BLE_STAGES ; i++ ) {
+
+    if ( !st->num[i] ) continue;
+
+    printf("%-8s %12lu %10lu %10lu %10lu %10lu\n", names[i], (unsigned long)st->num[i],
+      (unsigned long)(st->sum_ns[i] / st->num[i]), (unsigned long)ble_stage_pct(st, i, 0.5),
+      (unsigned long)ble_stage_pct(st, i, 0.99), (unsigned long)st->max_ns[i]);
+  }
+}
@@ -0,0 +1,140 @@
+/*
+ *
+ * Adrian Brzezinski (2020) <adrian.brzezinski at adrb.pl>
+ * License: GPLv2+
+ *
+ */
+
+#ifndef __BLE_SOURCE_H__
+#define __BLE_SOURCE_H__
+
+#include <stdint.h>
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+
+#include "ble_pkt.h"
+#include "ble_cap.h"
+#include "ble_out.h"
+
+// Capture source hands out advertising reports in batches. Reports look
+// the same whether they come from adapter, capture file or generator, so
+// single ingest path turns all of them into packets and streams.
+#define BLE_SOURCE_BATCH 256              // reports
+#define BLE_SOURCE_BATCH_BUF 65536        // bytes of report data
+
+// Report is le_advertising_info followed by RSSI byte, like in HCI event
+typedef struct {
+
+  uint64_t recv_us;
+  le_advertising_info *info;    // points into batch buffer
+  uint8_t src;                  // adapter index
+
+} ble_report_t;
+
+typedef struct {
+
+  uint32_t num;
+  uint32_t used;                // bytes of buffer taken
+
+  ble_report_t reps[BLE_SOURCE_BATCH];
+  uint8_t buf[BLE_SOURCE_BATCH_BUF];
+
+} ble_batch_t;
+
+typedef struct ble_source_s ble_source_t;
+
+typedef struct {
+
+  const char *name;
+
+  // Fill empty batch, returns number of reports, 0 at end of source or -1 on error.
+  // Reports stay valid until next call.
+  int (*next)( ble_source_t *s, ble_batch_t *batch );
+  void (*close)( ble_source_t *s );
+
+} ble_source_ops_t;
+
+struct ble_source_s {
+
+  const ble_source_ops_t *ops;
+  void *priv;
+
+};
+
+// Check if batch can take that many more reports and data bytes
+static inline int ble_batch_room( ble_batch_t *b, uint32_t reps, size_t bytes ) {
+  return b->num + reps <= BLE_SOURCE_BATCH && b->used + bytes <= BLE_SOURCE_BATCH_BUF;
+}
+
+// Reserve report with data length set, NULL if batch is full
+le_advertising_info* ble_batch_report( ble_batch_t *b, uint64_t recv_us, uint8_t src, uint8_t length );
+le_advertising_info* ble_batch_adv( ble_batch_t *b, uint64_t recv_us, uint8_t src,
+    le_advertising_info *info, int8_t rssi );
+le_advertising_info* ble_batch_en( ble_batch_t *b, uint64_t recv_us, uint8_t src,
+    bdaddr_t *bda, uint8_t bdaddr_type, ble_ga_adv_t *ga, int8_t rssi );
+
+int ble_source_next( ble_source_t *s, ble_batch_t *batch );
+void ble_source_close( ble_source_t *s );
+
+// Per stage latency of ingest, taken only when asked for (replay).
+// Histogram has power of 2 buckets of nanoseconds.
+typedef enum {
+
+  BLE_STAGE_QUEUE,          // event waits in ring
+  BLE_STAGE_PARSE,          // event to reports
+  BLE_STAGE_PKT,            // ble_info2pkt()
+  BLE_STAGE_STREAM,         // ble_stream_pkt_add()
+  BLE_STAGE_OUTPUT,         // capture file and output queue
+  BLE_STAGES
+
+} ble_stage;
+
+#define BLE_STAGE_BUCKETS 40
+
+typedef struct {
+
+  uint64_t num[BLE_STAGES];
+  uint64_t sum_ns[BLE_STAGES];
+  uint64_t max_ns[BLE_STAGES];
+  uint64_t hist[BLE_STAGES][BLE_STAGE_BUCKETS];
+
+} ble_stage_stats_t;
+
+static inline void ble_stage_add( ble_stage_stats_t *st, ble_stage stage, uint64_t ns ) {
+
+  int b = ns ? 64 - __builtin_clzll(ns) : 0;
+
+  st->num[stage]++;
+  st->sum_ns[stage] += ns;
+  if ( ns > st->max_ns[stage] ) st->max_ns[stage] = ns;
+  st->hist[stage][b < BLE_STAGE_BUCKETS ? b : BLE_STAGE_BUCKETS - 1]++;
+}
+
+void ble_stage_print( ble_stage_stats_t *st );
+
+// Where ingested packets go besides streams
+typedef struct {
+
+  ble_cap_writer_t *capw;
+  ble_out_t *out;
+  ble_stage_stats_t *stages;
+  int verbose;              // print every packet
+
+  uint64_t pkts;
+  uint64_t first_us;
+  uint64_t last_us;
+
+} ble_ingest_t;
+
+int ble_ingest_report( ble_ingest_t *ing, ble_report_t *rep );
+int ble_ingest( ble_source_t *s, ble_ingest_t *ing );
+
+// Sources of recorded reports, generator is in ble_gen.h
+int ble_cap_source( ble_source_t *s, char *filename, uint64_t from_us, uint64_t to_us );
+int ble_csv_source( ble_source_t *s, char *filename, uint64_t from_us, uint64_t to_us, int progress );
+
+// Replace streams with everything source has, source is closed
+int ble_source_load( ble_source_t *s, int verbose );
+int ble_source_bench( ble_source_t *s );
+
+#endif // __BLE_SOURCE_H__
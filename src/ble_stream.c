@@ -5,10 +5,24 @@
  *
  */
 
+#include <fcntl.h>
+#include <sys/mman.h>
+
 #include "bentool.h"
 
 ble_bonding_t *ble_bonding = NULL;
 ble_pkt_stream_t *ble_stream = NULL;
+ble_pkt_stream_t *ble_stream_free_list = NULL;  // streams released by merges, still linked in ble_stream
+
+ble_retention_t ble_retention = { 0 };
+uint64_t ble_retain_last_us = 0;
+uint32_t ble_retain_pkts = 0;
+uint64_t ble_retain_expired = 0;   // streams released by retention policy
+uint32_t ble_stream_num = 0;       // allocated streams, including released by merges
+
+// Latest BT address and latest RPI+AEM of every stream, for O(1) packet assignment
+ble_idx_t ble_stream_bda_idx = { .key_len = sizeof(bdaddr_t) };
+ble_idx_t ble_stream_en_idx = { .key_len = sizeof(((ble_ga_adv_t*)0)->rpi) + sizeof(((ble_ga_adv_t*)0)->aem) };
 
 // BT Core 5.0 spec, section 2.2.1 and 2.2.2
 //
@@ -17,13 +31,22 @@ ble_pkt_stream_t *ble_stream = NULL;
 int ble_resolve_rpa(bdaddr_t *bda, uint8_t irk[16]) {
 
   AES_KEY aes_ekey;
+
+  if ( !memcmp(irk,"\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0", 16) )  // key needs to be set
+      return 1;
+
+  AES_set_encrypt_key(irk, 128, &aes_ekey);
+
+return ble_resolve_rpa_key(bda, &aes_ekey);
+}
+
+// Same as above, but with already prepared IRK key schedule
+int ble_resolve_rpa_key(bdaddr_t *bda, AES_KEY *aes_ekey) {
+
   uint8_t in[16], out[16];
 
-  if ( !bda || (bda->b[5]&0xc0) != 0x40 ||                  // is it resolvable device address?
-       !memcmp(irk,"\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0", 16)  // key needs to be set
-       ) {
+  if ( !bda || (bda->b[5]&0xc0) != 0x40 )  // is it resolvable device address?
       return 1;
-  }
 
   memset(in, 0, 16);
   memset(out, 0, 16);
@@ -33,8 +56,7 @@ int ble_resolve_rpa(bdaddr_t *bda, uint8_t irk[16]) {
   in[14] = bda->b[4];
   in[15] = bda->b[3];
 
-  AES_set_encrypt_key(irk, 128, &aes_ekey);
-  AES_encrypt(in, out, &aes_ekey);
+  AES_encrypt(in, out, aes_ekey);
 
   // hash matched?
   if ( out[13] == bda->b[2] && out[14] == bda->b[1] && out[15] == bda->b[0] )
@@ -63,16 +85,28 @@ int ble_bonding_add(ble_bonding_t *new_bk) {
 
     if ( memcmp(new_bk->irk, "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0", 16) ) {
       memcpy(bk->irk, new_bk->irk, 16);
+
+      bk->has_irk = 1;
+      AES_set_encrypt_key(bk->irk, 128, &bk->aes_ekey);
     }
 
     free(new_bk->name);
     free(new_bk);
   } else {
 
+    // prepare key schedule once, it's used for every resolved address
+    if ( memcmp(new_bk->irk, "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0", 16) ) {
+      new_bk->has_irk = 1;
+      AES_set_encrypt_key(new_bk->irk, 128, &new_bk->aes_ekey);
+    }
+
     new_bk->next = ble_bonding;
     ble_bonding = new_bk;
   }
 
+  // bonding set changed, prepare keys for batch resolution and forget resolved addresses
+  ble_rpa_bonded_update(ble_bonding);
+
 return 0;
 }
 
@@ -101,26 +135,17 @@ void ble_bonding_print() {
 void ble_stream_free_p( ble_pkt_stream_t *bps ) {
 
   ble_pkt_stream_t *nexts;
-  ble_pkt_t *pkt, *older;
 
   if ( !bps ) return;
 
+  // packets are released with whole arena
   while ( bps ) {
 
-    pkt = bps->pkt_latest;
-
-    while ( pkt ) {
-
-      ble_pkt_t *older = pkt->older;
-
-      ble_pkt_free(pkt);
-
-      pkt = older;
-    }
-
     nexts = bps->next;
 
+    ble_cols_free(&bps->cols);
     free(bps);
+    ble_stream_num--;
 
     bps = nexts;
   }
@@ -130,238 +155,427 @@ void ble_stream_free_p( ble_pkt_stream_t *bps ) {
 // deallocate packets captured during previous scan
 void ble_stream_free() {
 
+  // whole address table goes at once, columns don't need to release addresses
+  ble_addr_free();
+
   if ( ble_stream ) {
     ble_stream_free_p(ble_stream);
     ble_stream = NULL;
   }
+
+  ble_pkt_arena_free();
+
+  ble_stream_free_list = NULL;
+  ble_retain_last_us = 0;
+  ble_retain_pkts = 0;
+  ble_retain_expired = 0;
+
+  ble_idx_free(&ble_stream_bda_idx);
+  ble_idx_free(&ble_stream_en_idx);
 }
 
-int ble_stream_dump(char *filename) {
+// Drop index entries pointing to stream's latest packet
+void ble_stream_idx_del( ble_pkt_stream_t *bps ) {
+
+  ble_pkt_t *pkt = ble_stream_latest(bps);
+
+  if ( !pkt ) return;
+
+  ble_idx_del(&ble_stream_bda_idx, &pkt->bda, bps);
+
+  if ( pkt->data_type == BLE_GA_EN )
+    ble_idx_del(&ble_stream_en_idx, pkt->data.ga.rpi, bps);
+}
+
+void ble_stream_idx_set( ble_pkt_stream_t *bps ) {
+
+  ble_pkt_t *pkt = ble_stream_latest(bps);
+
+  if ( !pkt ) return;
+
+  ble_idx_set(&ble_stream_bda_idx, &pkt->bda, bps);
+
+  if ( pkt->data_type == BLE_GA_EN )
+    ble_idx_set(&ble_stream_en_idx, pkt->data.ga.rpi, bps);
+}
+
+#define BLE_CSV_BUF_SIZE (1 << 20)
+#define BLE_CSV_LINE_MAX 640    // numbers, address and up to 264 bytes of hex payload
+
+static inline char* ble_csv_put_num( char *o, uint64_t v ) {
+
+  char tmp[20];
+  int n = 0;
+
+  do {
+    tmp[n++] = '0' + v % 10;
+    v /= 10;
+  } while ( v );
+
+  while ( n ) *o++ = tmp[--n];
+
+return o;
+}
+
+// Same format as ba2str()
+static inline char* ble_csv_put_bda( char *o, bdaddr_t *bda ) {
+
+  static const char hex[] = "0123456789ABCDEF";
+
+  for ( int i = 5 ; i >= 0 ; i-- ) {
+    *o++ = hex[bda->b[i] >> 4];
+    *o++ = hex[bda->b[i] & 0xf];
+    *o++ = i ? ':' : ',';
+  }
+
+return o;
+}
+
+// Lines are formatted into big buffer, which is written when it gets full
+static int ble_csv_dump( char *filename ) {
 
   ble_pkt_stream_t *bps;
   ble_pkt_t *pkt;
+  uint64_t num = 0, done = 0;
+  char *buf, *o;
+  uint32_t i;
+  FILE *f;
+  int ret = 0;
 
-  if ( !filename ) return -1;
+  if ( !(f = fopen(filename, "w")) ) {
+    perror("Couldn't create file");
+    return -1;
+  }
 
-  FILE *f = fopen(filename, "w");
+  if ( (buf = malloc(BLE_CSV_BUF_SIZE)) == NULL ) {
+    perror("Could not allocate output buffer");
+    exit(ENOMEM);
+  }
 
-  for ( bps = ble_stream ; bps ; bps = bps->next ) {
+  for ( bps = ble_stream ; bps ; bps = bps->next )
+    num += bps->cols.num;
+
+  for ( bps = ble_stream, o = buf ; bps && !ret ; bps = bps->next ) {
 
     // Dump in order of receiptment
-    for ( pkt = bps->pkt_head ; pkt ; pkt = pkt->newer ) {
+    for ( i = 0 ; i < bps->cols.num ; i++ ) {
 
-      print_busyloop();
+      pkt = ble_pkt_get(bps->cols.pkt[i]);
 
-      char addr[18];
-      ba2str(&(pkt->bda), addr);
+      o = ble_csv_put_num(o, pkt->recv_us / 1000000);
+      *o++ = ',';
+      o = ble_csv_put_num(o, pkt->recv_us % 1000000);
+      *o++ = ',';
+      o = ble_csv_put_bda(o, &pkt->bda);
 
-      fprintf(f, "%ld,%ld,%s,%d,",
-        pkt->recv_time.tv_sec, pkt->recv_time.tv_usec,
-        addr, pkt->rssi);
+      if ( pkt->rssi < 0 ) *o++ = '-';
+      o = ble_csv_put_num(o, abs(pkt->rssi));
+      *o++ = ',';
 
       switch (pkt->data_type) {
 
       case BLE_ADV_INFO:
-
-        for ( int d = 0 ; d < sizeof(le_advertising_info) ; d++ )
-          fprintf(f, "%02x", ((uint8_t*)pkt->data.advinfo)[d]);
-
-        for ( int d = 0 ; d < pkt->data.advinfo->length ; d++ )
-          fprintf(f, "%02x", pkt->data.advinfo->data[d]);
-
+        o = hexencode(o, (uint8_t*)pkt->data.advinfo, sizeof(le_advertising_info) + pkt->data.advinfo->length);
       break;
 
       case BLE_GA_EN:
+        o = hexencode(o, (uint8_t*)&pkt->data.ga, sizeof(ble_ga_adv_t));
+      break;
+      }
 
-        ;
+      *o++ = '\n';
 
-        ble_ga_adv_t *ga_info = pkt->data.ga;
+      if ( o - buf > BLE_CSV_BUF_SIZE - BLE_CSV_LINE_MAX ) {
 
-        for ( int d = 0 ; d < sizeof(ble_ga_adv_t) ; d++ )
-          fprintf(f, "%02x", ((uint8_t*)ga_info)[d]);
+        if ( fwrite(buf, o - buf, 1, f) != 1 ) {
+          ret = -1;
+          break;
+        }
 
-      break;
+        o = buf;
+        print_progress("Dumping", done + i, num);
       }
-
-      fprintf(f,"\n");
     }
+
+    done += bps->cols.num;
   }
 
-  fflush(f);
-  fclose(f);
+  if ( !ret && o > buf && fwrite(buf, o - buf, 1, f) != 1 )
+    ret = -1;
 
-  // clear busy loop char
-  printf("\b");
-  fflush(stdout);
+  if ( fclose(f) ) ret = -1;
 
-return 0;
+  free(buf);
+
+  print_progress("Dumping", num, num);
+
+  if ( ret )
+    perror("Couldn't write file");
+  else
+    printf("Dumped %lu packets\n", (unsigned long)num);
+
+return ret;
 }
 
-int ble_stream_load(char *filename) {
+int ble_stream_dump(char *filename) {
 
-  FILE *f;
-  ble_pkt_t *pkt = NULL;
-  char buf[4096];
-  char *tok;
-  unsigned int val;
-  int ret = 0, col;
+  size_t len;
 
   if ( !filename ) return -1;
 
-  if ( !(f = fopen(filename, "r")) ) {
-    perror("Coudn't load file");
-    return -1;
+  // CSV only if asked for by file extension
+  len = strlen(filename);
+  if ( len >= 4 && !strcasecmp(filename + len - 4, ".csv") )
+    return ble_csv_dump(filename);
+
+return ble_cap_dump(filename);
+}
+
+// Parse unsigned decimal number, returns pointer to character after it
+static inline const char* ble_csv_num( const char *p, const char *end, uint64_t *val ) {
+
+  uint64_t v = 0;
+
+  for ( ; p < end && *p >= '0' && *p <= '9' ; p++ )
+    v = v * 10 + (*p - '0');
+
+  *val = v;
+
+return p;
+}
+
+// XX:XX:XX:XX:XX:XX, bytes are stored in reversed order like str2ba() does
+static inline const char* ble_csv_bda( const char *p, const char *end, bdaddr_t *bda ) {
+
+  memset(bda, 0, sizeof(bdaddr_t));
+
+  for ( int i = 5 ; i >= 0 && p + 2 <= end ; i-- ) {
+    if ( hexdecode(&bda->b[i], p, 1) != 1 ) break;
+    p += 2;
+    if ( p < end && *p == ':' ) p++;
   }
 
-  ble_stream_free();
+return p;
+}
 
-  while ( fgets(buf, sizeof(buf), f)  ) {
+// Decode single CSV line: sec,usec,bda,rssi,payload into report of batch
+static int ble_csv_line( const char *p, const char *end, uint64_t from_us, uint64_t to_us, ble_batch_t *batch ) {
 
-//    print_busyloop();
+  le_advertising_info info_hdr, *rep;
+  ble_ga_adv_t ga;
+  bdaddr_t bda;
+  uint64_t sec, usec, recv_us;
+  int8_t rssi;
+  int neg, len;
 
-    for ( col = 0, tok = strtok(buf, ",") ; tok && *tok ; tok = strtok(NULL, ",\n"), col++ ) {
+  p = ble_csv_num(p, end, &sec);
+  if ( p >= end || *p++ != ',' ) return -1;
 
-//      printf("%i: %s\n", col, tok);
+  p = ble_csv_num(p, end, &usec);
+  if ( p >= end || *p++ != ',' ) return -1;
 
-      // alocate new pkt on column 0
-      if ( !pkt && (pkt = calloc(1, sizeof(ble_pkt_t) )) == NULL ) {
-        goto badv_load_csv_enomem;
-      }
+  recv_us = sec * 1000000 + usec;
+  if ( recv_us < from_us || (to_us && recv_us > to_us) )
+    return 0;
 
-      switch ( col % 5 ) {
-      case 0:
-        pkt->recv_time.tv_sec = atol(tok);
-      break;
-      case 1:
-        pkt->recv_time.tv_usec = atol(tok);
-      break;
-      case 2:
-        str2ba(tok, &pkt->bda);
-      break;
-      case 3:
-         pkt->rssi = atoi(tok);
-      break;
-      case 4:
-        if ( strncmp(tok, "17166ffd", 8) ) {
-          pkt->data_type = BLE_ADV_INFO;
+  p = ble_csv_bda(p, end, &bda);
+  if ( p >= end || *p++ != ',' ) return -1;
 
-          le_advertising_info *info_tok = (le_advertising_info*)tok;
+  if ( (neg = (p < end && *p == '-')) ) p++;
+  p = ble_csv_num(p, end, &usec);
+  rssi = neg ? -(int)usec : (int)usec;
+  if ( p >= end || *p++ != ',' ) return -1;
 
-          if ( (pkt->data.advinfo = (le_advertising_info*) malloc(sizeof(le_advertising_info)+info_tok->length)) == NULL ) {
-            goto badv_load_csv_enomem;
-          }
+  // hex digits available in payload column
+  len = (end - p) >> 1;
 
-          for ( int i = 0; i < sizeof(le_advertising_info) << 1 && tok[i] ; i += 2 ) {
-            val = 0;
-            sscanf(tok+i, "%02x", &val);
+  if ( len < 4 || memcmp(p, "17166ffd", 8) ) {
 
-            ((uint8_t*)pkt->data.advinfo)[i >> 1] = val & 0xff;
-          }
+    memset(&info_hdr, 0, sizeof(info_hdr));
+    hexdecode((uint8_t*)&info_hdr, p, len < sizeof(info_hdr) ? len : sizeof(info_hdr));
 
-          for ( int i = 0; i < pkt->data.advinfo->length << 1 && tok[i] ; i += 2 ) {
-            val = 0;
-            sscanf(tok+i, "%02x", &val);
+    rep = ble_batch_report(batch, recv_us, 0, info_hdr.length);
+    memcpy(rep, &info_hdr, sizeof(le_advertising_info));
+    bacpy(&rep->bdaddr, &bda);
 
-            pkt->data.advinfo->data[i >> 1] = val & 0xff;
-          }
+    // advertising data follows header, missing part is zeroed
+    memset(rep->data, 0, rep->length);
+    if ( len > sizeof(le_advertising_info) )
+      hexdecode(rep->data, p + (sizeof(le_advertising_info) << 1),
+        len - sizeof(le_advertising_info) < info_hdr.length ? len - sizeof(le_advertising_info) : info_hdr.length);
 
-        } else {
-          pkt->data_type = BLE_GA_EN;
+    rep->data[rep->length] = rssi;
 
-          if ( (pkt->data.ga = (ble_ga_adv_t*) malloc(sizeof(ble_ga_adv_t))) == NULL ) {
-            goto badv_load_csv_enomem;
-          }
+  } else {
 
-          for ( int i = 0; i < sizeof(ble_ga_adv_t) << 1 && tok[i] ; i += 2 ) {
-            val = 0;
-            sscanf(tok+i, "%02x", &val);
+    memset(&ga, 0, sizeof(ga));
+    hexdecode((uint8_t*)&ga, p, len < sizeof(ble_ga_adv_t) ? len : sizeof(ble_ga_adv_t));
 
-            ((uint8_t*)pkt->data.ga)[i >> 1] = val & 0xff;
-          }
+    ble_batch_en(batch, recv_us, 0, &bda, 0, &ga, rssi);
+  }
 
-        }
+return 0;
+}
 
-        // Last column, push pkt to stream
-        ble_pkt_print(pkt, 0);
-        printf("\n");
+typedef struct {
 
-        if ( (ret = ble_stream_pkt_add(pkt)) < 0 )
-          goto badv_load_csv_exit;
+  const char *map;
+  size_t map_len;
 
-        pkt = NULL;
+  const char *p;
+  uint64_t lines;
+  uint64_t from_us;
+  uint64_t to_us;
+  int progress;
 
-      break;
+} ble_csv_source_t;
 
-      default:
-        fprintf(stderr, "Unknown line format!");
-        ret = -1;
-        goto badv_load_csv_exit;
-      }
+static int ble_csv_source_next( ble_source_t *s, ble_batch_t *batch ) {
+
+  ble_csv_source_t *cs = s->priv;
+  const char *eol, *end = cs->map + cs->map_len;
+
+  // whole line has to fit, advertising data is at most 255 bytes
+  for ( ; cs->p < end && ble_batch_room(batch, 1, sizeof(le_advertising_info) + 256) ; cs->p = eol + 1 ) {
 
+    if ( !(eol = memchr(cs->p, '\n', end - cs->p)) ) eol = end;
+    cs->lines++;
+
+    if ( !(cs->lines & 0xffff) && cs->progress )
+      print_progress("Loading", cs->p - cs->map, cs->map_len);
+
+    if ( eol == cs->p || (eol - cs->p == 1 && *cs->p == '\r') ) continue;
+
+    if ( ble_csv_line(cs->p, eol > cs->p && eol[-1] == '\r' ? eol - 1 : eol, cs->from_us, cs->to_us, batch) < 0 ) {
+      fprintf(stderr, "Unknown line format at line %lu!\n", (unsigned long)cs->lines);
+      return -1;
     }
   }
 
-badv_load_csv_exit:
+  if ( cs->p >= end && !batch->num && cs->progress )
+    print_progress("Loading", cs->map_len, cs->map_len);
 
-  // clear busy loop char
-//  printf("\b");
-//  fflush(stdout);
+return batch->num;
+}
 
-  fclose(f);
+static void ble_csv_source_close( ble_source_t *s ) {
 
-return ret;
+  ble_csv_source_t *cs = s->priv;
 
-badv_load_csv_enomem:
+  if ( cs->map_len ) munmap((void*)cs->map, cs->map_len);
+  free(cs);
+}
 
-  fclose(f);
+static const ble_source_ops_t ble_csv_source_ops = {
+  .name = "CSV file",
+  .next = ble_csv_source_next,
+  .close = ble_csv_source_close,
+};
 
-  perror("Could not allocate packet");
-  exit(ENOMEM);
+int ble_csv_source( ble_source_t *s, char *filename, uint64_t from_us, uint64_t to_us, int progress ) {
 
-return -1;
-}
+  ble_csv_source_t *cs;
+  struct stat st;
+  int fd;
 
-int ble_stream_pkt_add( ble_pkt_t *pkt ) {
+  if ( (fd = open(filename, O_RDONLY)) < 0 ) {
+    perror("Coudn't load file");
+    return -1;
+  }
 
-  ble_pkt_stream_t *bps, *bps_free = NULL;
+  if ( fstat(fd, &st) ) {
+    perror("Coudn't load file");
+    close(fd);
+    return -1;
+  }
 
-  if ( !pkt ) return -1;
+  if ( (cs = calloc(1, sizeof(ble_csv_source_t))) == NULL ) {
+    perror("Could not allocate CSV source");
+    exit(ENOMEM);
+  }
 
-  // Assign packet to stream, if no match then bps = NULL
-  for ( bps = ble_stream ; bps ; bps = bps->next ) {
+  if ( st.st_size ) {
 
-    // mark free stream
-    if ( !bps->pkt_latest ) {
-      bps_free = bps;
-      continue;
-    }
+    cs->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
 
-    // Same BT Address
-    if ( !bacmp(&bps->pkt_latest->bda, &pkt->bda) ) {
-      break;
+    if ( cs->map == MAP_FAILED ) {
+      perror("Couldn't map file");
+      close(fd);
+      free(cs);
+      return -1;
     }
 
-    // Same RPI and AEM
-    if ( pkt->data_type == BLE_GA_EN && bps->pkt_latest->data_type == BLE_GA_EN &&
-         !memcmp(pkt->data.ga->rpi, bps->pkt_latest->data.ga->rpi, 16) &&
-         !memcmp(pkt->data.ga->aem, bps->pkt_latest->data.ga->aem, 4)
-       ) {
+    cs->map_len = st.st_size;
+    madvise((void*)cs->map, st.st_size, MADV_SEQUENTIAL);
+  }
 
-      // BT Address changed, so set RPA change time
-      bps->rpa_last_change.tv_sec = pkt->recv_time.tv_sec;
-      bps->rpa_last_change.tv_usec = pkt->recv_time.tv_usec;
+  close(fd);
 
-      break;
-    }
+  cs->p = cs->map;
+  cs->from_us = from_us;
+  cs->to_us = to_us;
+  cs->progress = progress;
+
+  s->ops = &ble_csv_source_ops;
+  s->priv = cs;
+
+return 0;
+}
+
+int ble_stream_load(char *filename, uint64_t from_us, uint64_t to_us, int verbose) {
+
+  ble_source_t s;
+
+  if ( !filename ) return -1;
+
+  if ( ble_cap_probe(filename) )
+    return ble_cap_load(filename, from_us, to_us, verbose);
+
+  if ( ble_csv_source(&s, filename, from_us, to_us, !verbose) < 0 )
+    return -1;
+
+return ble_source_load(&s, verbose);
+}
+
+// Account time gap between consecutive packets of stream
+static inline void ble_stream_gap_add( ble_pkt_stream_t *bps, ble_pkt_t *older, ble_pkt_t *newer ) {
+
+  uint64_t gap = newer->recv_us - older->recv_us;
+
+  // Maximum allowed interval between packets is 10.24sec
+  if ( gap > BLE_PKT_GAP_MAX ) return;
+
+  bps->pkt_gap_usum += gap;
+  bps->pkts++;
+}
+
+int ble_stream_pkt_add( ble_pkt_t *pkt ) {
+
+  ble_pkt_stream_t *bps;
+
+  if ( !pkt ) return -1;
 
+  // Assign packet to stream, if no match then bps = NULL
+
+  // Same BT Address
+  bps = ble_idx_get(&ble_stream_bda_idx, &pkt->bda);
+
+  // Same RPI and AEM
+  if ( !bps && pkt->data_type == BLE_GA_EN &&
+       (bps = ble_idx_get(&ble_stream_en_idx, pkt->data.ga.rpi)) ) {
+
+    // BT Address changed, so set RPA change time
+    usec2tv(pkt->recv_us, &bps->rpa_last_change);
   }
 
   // no match found
   if ( !bps ) {
 
-    if ( bps_free ) {
+    if ( ble_stream_free_list ) {
 
-      bps = bps_free;
+      bps = ble_stream_free_list;
+      ble_stream_free_list = bps->free_next;
+      bps->free_next = NULL;
 
     } else {
 
@@ -375,213 +589,476 @@ int ble_stream_pkt_add( ble_pkt_t *pkt ) {
       bps->prev = NULL;
       if ( ble_stream ) ble_stream->prev = bps;
       ble_stream = bps;
+      ble_stream_num++;
     }
 
   }
 
   // add packet to selected chain
-  ble_pkt_t *older = bps->pkt_latest;
+  ble_pkt_t *older = ble_stream_latest(bps);
+  int reindex = !older || bacmp(&older->bda, &pkt->bda) || older->data_type != pkt->data_type ||
+    (pkt->data_type == BLE_GA_EN && memcmp(older->data.ga.rpi, pkt->data.ga.rpi, ble_stream_en_idx.key_len));
+
+  // reindex only if stream keys changed
+  if ( reindex ) ble_stream_idx_del(bps);
 
+  if ( !bps->cols.num && !bps->first_us )
+    bps->first_us = pkt->recv_us;
+
+  ble_cols_push(&bps->cols, pkt);
+
+  if ( reindex ) ble_stream_idx_set(bps);
+
+  // update stream metrics
   if ( older )
-    older->newer = pkt;
+    ble_stream_gap_add(bps, older, pkt);
+
+  if ( pkt->data_type == BLE_GA_EN ) {
+    ble_pkt_t *prev = bps->ga_latest;
+
+    bps->ga_latest = pkt;
+    if ( !bps->ga_head )
+      bps->ga_head = pkt;
 
-  pkt->older = older;
-  pkt->newer = NULL;
+    // previous GA packet could be kept only for tracking
+    if ( prev && prev->evicted && prev != bps->ga_head )
+      ble_pkt_release(prev);
+  }
 
-  bps->pkt_latest = pkt;
-  if ( !bps->pkt_head )
-    bps->pkt_head = pkt;
+  // keep memory bounded on long scans, packets could come a bit out of order
+  if ( (ble_retention.max_age_us || ble_retention.max_stream_pkts || ble_retention.max_mem) &&
+       (++ble_retain_pkts >= BLE_RETAIN_PKTS ||
+        (pkt->recv_us > ble_retain_last_us && pkt->recv_us - ble_retain_last_us >= BLE_RETAIN_PERIOD_US)) )
+    ble_stream_retain(pkt->recv_us);
 
 return 0;
 }
 
-// Gather stream metadata
-void ble_stream_meta() {
+// Drop num oldest packets of stream
+static void ble_stream_evict( ble_pkt_stream_t *bps, uint32_t num ) {
 
-  ble_pkt_stream_t *bps;
   ble_pkt_t *pkt;
-  uint64_t gap;
 
-  for ( bps = ble_stream ; bps ; bps = bps->next ) {
+  // latest packet stays, it keeps stream in indexes
+  if ( num >= bps->cols.num ) num = bps->cols.num - 1;
+
+  for ( uint32_t i = 0 ; i < num ; i++ ) {
 
-    bps->pkt_gap_usum = 0;
-    bps->pkts = 0;
+    pkt = ble_pkt_get(bps->cols.pkt[i]);
+
+    // first and last GA packets are used by tracking. Those dropped
+    // from stream by merge are not released, there are few of them.
+    if ( pkt != bps->ga_head && pkt != bps->ga_latest )
+      ble_pkt_release(pkt);
+    else
+      pkt->evicted = 1;
+  }
 
-    for ( pkt = bps->pkt_latest ; pkt && pkt->older ; pkt = pkt->older ) {
+  bps->evicted += num;
+  ble_cols_drop(&bps->cols, num);
+}
 
-      gap = (pkt->recv_time.tv_sec*1000000 + pkt->recv_time.tv_usec) - (pkt->older->recv_time.tv_sec*1000000 + pkt->older->recv_time.tv_usec);
+// Packets of stream received before cut_us, without latest one
+static inline uint32_t ble_stream_older( ble_pkt_stream_t *bps, uint64_t cut_us ) {
 
-      // Maximum allowed interval between packets is 10.24sec
-      if ( gap > 10240000 ) continue;
+  uint32_t n = ble_cols_lower(&bps->cols, cut_us);
 
-      bps->pkt_gap_usum += (pkt->recv_time.tv_sec*1000000 + pkt->recv_time.tv_usec) - (pkt->older->recv_time.tv_sec*1000000 + pkt->older->recv_time.tv_usec);
-      bps->pkts++;
+return n < bps->cols.num ? n : bps->cols.num - 1;
+}
 
-      /* Now set inside of ble_stream_pkt_add
-      // Set RPA change time if addresses don't match but RPI and AEM does
-      if ( !bps->rpa_last_change.tv_sec && bacmp(&pkt->bda, &pkt->older->ba) ) {
+static inline uint64_t ble_stream_latest_us( ble_pkt_stream_t *bps ) {
+  return bps->cols.ts[bps->cols.num - 1];
+}
 
-        if ( !memcmp(pkt->data.ga->rpi, pkt->older->data.ga->rpi, 16) &&
-            !memcmp(pkt->data.ga->aem, pkt->older->data.ga->aem, 4) ) {
+static void ble_stream_unlink( ble_pkt_stream_t *bps ) {
 
-          bps->rpa_last_change.tv_sec = pkt->recv_time.tv_sec;
-          bps->rpa_last_change.tv_usec = pkt->recv_time.tv_usec;
-        }
-      }
-      */
+  if ( bps->prev ) bps->prev->next = bps->next;
+  else ble_stream = bps->next;
+
+  if ( bps->next ) bps->next->prev = bps->prev;
+
+  ble_stream_num--;
+}
+
+// Release whole stream with all its packets
+static void ble_stream_expire( ble_pkt_stream_t *bps ) {
+
+  ble_stream_idx_del(bps);
+
+  // GA packets evicted from columns are held only by stream
+  if ( bps->ga_head && bps->ga_head->evicted )
+    ble_pkt_release(bps->ga_head);
+
+  if ( bps->ga_latest && bps->ga_latest != bps->ga_head && bps->ga_latest->evicted )
+    ble_pkt_release(bps->ga_latest);
+
+  for ( uint32_t i = 0 ; i < bps->cols.num ; i++ )
+    ble_pkt_release(ble_pkt_get(bps->cols.pkt[i]));
+
+  ble_cols_free(&bps->cols);
+  ble_stream_unlink(bps);
+  free(bps);
+
+  ble_retain_expired++;
+}
+
+// Everything kept for streams: packets, columns with their capacity,
+// stream records, addresses and indexes
+size_t ble_stream_mem() {
+
+  ble_pkt_stream_t *bps;
+  size_t used;
+
+  used = ble_pkt_mem() + ble_addr_mem() + (size_t)ble_stream_num * sizeof(ble_pkt_stream_t) +
+    ble_idx_mem(&ble_stream_bda_idx) + ble_idx_mem(&ble_stream_en_idx);
+
+  for ( bps = ble_stream ; bps ; bps = bps->next )
+    used += ble_cols_mem(&bps->cols);
+
+return used;
+}
+
+// Packets gone if everything received before cut_us is dropped,
+// stream goes whole when its latest packet is older
+static inline uint32_t ble_stream_cut( ble_pkt_stream_t *bps, uint64_t cut_us ) {
+  return ble_stream_latest_us(bps) < cut_us ? bps->cols.num : ble_stream_older(bps, cut_us);
+}
+
+void ble_stream_retain( uint64_t now_us ) {
+
+  ble_pkt_stream_t *bps, *nexts;
+  uint64_t entries = 0, oldest_us = now_us, cut_us = 0, lo, hi, mid, cnt, target;
+  size_t used;
+  uint32_t n;
+
+  ble_retain_last_us = now_us;
+  ble_retain_pkts = 0;
+
+  // streams released by merges are empty, new streams are allocated anyway
+  while ( ble_stream_free_list ) {
+    bps = ble_stream_free_list;
+    ble_stream_free_list = bps->free_next;
+    ble_stream_unlink(bps);
+    free(bps);
+  }
+
+  if ( ble_retention.max_age_us && now_us > ble_retention.max_age_us )
+    cut_us = now_us - ble_retention.max_age_us;
+
+  for ( bps = ble_stream ; bps ; bps = nexts ) {
+
+    nexts = bps->next;
+
+    if ( !bps->cols.num ) continue;
+
+    // device is gone
+    if ( ble_stream_latest_us(bps) < cut_us ) {
+      ble_stream_expire(bps);
+      continue;
+    }
 
+    n = 0;
+
+    if ( ble_retention.max_stream_pkts && bps->cols.num > ble_retention.max_stream_pkts )
+      n = bps->cols.num - ble_retention.max_stream_pkts;
+
+    if ( cut_us ) {
+      uint32_t aged = ble_stream_older(bps, cut_us);
+      if ( aged > n ) n = aged;
     }
+
+    if ( n ) ble_stream_evict(bps, n);
+
+    entries += bps->cols.num;
+    if ( bps->cols.ts[0] < oldest_us ) oldest_us = bps->cols.ts[0];
   }
 
+  if ( !ble_retention.max_mem || !entries ) return;
+
+  used = ble_stream_mem();
+  if ( used <= ble_retention.max_mem ) return;
+
+  // Go down to 90% of budget, so it's not applied on every sweep.
+  // Every packet carries its share of streams, addresses and indexes.
+  target = entries - (ble_retention.max_mem / 10 * 9) / (used / entries);
+
+  // Search cut time, so that packets received before it are enough
+  for ( lo = oldest_us, hi = now_us ; lo < hi ; ) {
+
+    mid = lo + (hi - lo)/2;
+
+    for ( bps = ble_stream, cnt = 0 ; bps && cnt < target ; bps = bps->next )
+      if ( bps->cols.num ) cnt += ble_stream_cut(bps, mid);
+
+    if ( cnt < target ) lo = mid + 1;
+    else hi = mid;
+  }
+
+  for ( bps = ble_stream ; bps ; bps = nexts ) {
+
+    nexts = bps->next;
+
+    if ( !bps->cols.num ) continue;
+
+    if ( ble_stream_latest_us(bps) < lo )
+      ble_stream_expire(bps);
+    else
+      ble_stream_evict(bps, ble_stream_older(bps, lo));
+  }
 }
 
-// Keep in mind that it process data in reverse order (from newest packet to oldest)
-int ble_stream_track() {
+// No bonding, so we guess if newer stream is continuation of older one
+static int ble_stream_track_guess( ble_pkt_stream_t *bps_older, ble_pkt_t *last_pkt,
+    ble_pkt_stream_t *bps_newer, ble_pkt_t *next_pkt, uint64_t *bps_rpa_gap ) {
+
+  *bps_rpa_gap = 0;
+
+  // Next packet before our device last packet?
+  if ( next_pkt->recv_us / 1000000 < last_pkt->recv_us / 1000000 ) {
+    return 0;
+  }
+
+  // Too long packet gap?
+  if ( (next_pkt->recv_us / 1000000 - last_pkt->recv_us / 1000000) > BLE_TRACK_GAP_MAX ) {
+    return 0;
+  }
+
+  // RPA interval if it's set, kept by merge but doesn't decide it
+  if ( bps_newer->rpa_last_change.tv_sec && bps_older->rpa_last_change.tv_sec )
+    *bps_rpa_gap = labs(tvusec(&bps_newer->rpa_last_change) - tvusec(&bps_older->rpa_last_change));
+
+  // RSSI more or less the same?
+  if ( abs(next_pkt->rssi - last_pkt->rssi) > 20 ) {
+    return 0;
+  }
+
+return 1;
+}
+
+// Merge older stream to newer, older stream is released
+static void ble_stream_merge( ble_pkt_stream_t *bps_older, int older_index,
+    ble_pkt_stream_t *bps_newer, int newer_index, ble_bonding_t *bk, uint64_t bps_rpa_gap, int verbose ) {
+
+  if ( verbose ) {
+    printf("Merging stream %d to %d (%s):\n\t newer - average gap between packets %.3lfs, last RPA change ",
+      older_index, newer_index, bk ? bk->name : "not bonded",
+      ( (double)bps_newer->pkt_gap_usum / (double)bps_newer->pkts )/1000000.0);
+    print_tv(&bps_newer->rpa_last_change);
+    printf(", RPA inverval %.3lfs\n\t  head ", bps_newer->rpa_interval_us/1000000.0 );
+    ble_pkt_print(ble_stream_head(bps_newer), 0);
+    printf("\n\t  tail ");
+    ble_pkt_print(ble_stream_latest(bps_newer), 0);
+
+    printf("\n\t older - average gap between packets %.3lfs, last RPA change ",
+      ( (double)bps_older->pkt_gap_usum / (double)bps_older->pkts )/1000000.0);
+    print_tv(&bps_older->rpa_last_change);
+    printf(", RPA inverval %.3lfs\n\t  head ", bps_older->rpa_interval_us/1000000.0 );
+    ble_pkt_print(ble_stream_head(bps_older), 0);
+    printf("\n\t  tail ");
+    ble_pkt_print(ble_stream_latest(bps_older), 0);
+
+    printf("\n");
+  }
+
+  // If it's the same device, merge older stream to newer
+  ble_stream_idx_del(bps_older);
+
+  ble_stream_gap_add(bps_newer, ble_stream_latest(bps_older), ble_stream_head(bps_newer));
+  bps_newer->pkts += bps_older->pkts;
+  bps_newer->pkt_gap_usum += bps_older->pkt_gap_usum;
+  bps_newer->evicted += bps_older->evicted;
+  if ( bps_older->first_us ) bps_newer->first_us = bps_older->first_us;
+
+  ble_cols_join(&bps_older->cols, &bps_newer->cols);
+
+  if ( bps_older->ga_head ) bps_newer->ga_head = bps_older->ga_head;
+  if ( !bps_newer->ga_latest ) bps_newer->ga_latest = bps_older->ga_latest;
+
+  if ( bps_rpa_gap ) bps_newer->rpa_interval_us = bps_rpa_gap;
+
+  // we moving back in time, so copy over from older stream if it's set
+  if ( bps_older->rpa_last_change.tv_sec ) {
+    bps_newer->rpa_last_change.tv_sec = bps_older->rpa_last_change.tv_sec;
+    bps_newer->rpa_last_change.tv_usec = bps_older->rpa_last_change.tv_usec;
+  }
+
+  // release older stream
+  bps_older->free_next = ble_stream_free_list;
+  ble_stream_free_list = bps_older;
+
+  bps_older->ga_head = NULL;
+  bps_older->ga_latest = NULL;
+  bps_older->pkts = 0;
+  bps_older->pkt_gap_usum = 0;
+  bps_older->first_us = 0;
+  bps_older->evicted = 0;
+  bps_older->rpa_interval_us = 0;
+  memset((void*)&bps_older->rpa_last_change, 0, sizeof(struct timeval));
+}
+
+// Earliest GA packet of a chain, sorted by time
+typedef struct {
+
+  ble_pkt_t *pkt;
+  ble_bonding_t *bk;    // bonding resolved from packet address
+  int holder;           // index of stream holding the chain
+  int consumed;         // some older stream was merged before it
+
+} ble_track_start_t;
+
+typedef struct {
+
+  ble_pkt_stream_t *bps;
+  ble_pkt_t *last_pkt;  // latest GA packet in stream
+  int start;            // chain start, -1 if there are no GA packets
+
+} ble_track_node_t;
+
+static int ble_track_start_cmp( const void *a, const void *b ) {
+
+  const ble_track_start_t *sa = a, *sb = b;
+
+  if ( sa->pkt->recv_us / 1000000 != sb->pkt->recv_us / 1000000 )
+    return sa->pkt->recv_us < sb->pkt->recv_us ? -1 : 1;
+
+return sa->holder - sb->holder;
+}
+
+// Merge all possible streams in single pass.
+//
+// Every stream end (last GA packet) is matched against chain starts (earliest GA packet)
+// of other streams. Starts are sorted by time, so unbonded candidates are looked up
+// only inside BLE_TRACK_GAP_MAX window after stream end, and bonded ones are kept aside.
+// Streams are processed in list order and the first matching stream on the list wins.
+// Match depends only on stream end and chain start packets (time, RSSI, bonding), which
+// merges don't change, so merges are the same as if all stream pairs were compared until
+// nothing changes. Checks of stream metrics that merge updates would break that.
+int ble_stream_track( int verbose ) {
 
   ble_bonding_t *bk;
-  ble_pkt_stream_t *bps_older, *bps_newer;
-  ble_pkt_t *pkt, *last_pkt, *next_pkt;
-  double newer_avg_gap, older_avg_gap;
-  uint64_t bps_rpa_gap;
-  int merges = 0, older_index, newer_index, bonded;
+  ble_pkt_stream_t *bps;
+  ble_pkt_t *last_pkt;
+  ble_track_node_t *nodes;
+  ble_track_start_t *starts, *st;
+  int *bonded_starts;
+  uint64_t bps_rpa_gap, match_rpa_gap;
+  int merges = 0, nodes_num, starts_num, bonded_num, older, newer, match, lo, hi;
 
   if ( !ble_stream ) {
     fprintf(stderr, "No data to track\n");
     return -1;
   }
 
-  ble_stream_meta();
+  for ( nodes_num = 0, bps = ble_stream ; bps ; bps = bps->next ) nodes_num++;
 
-  // Merge streams
-  for ( bps_older = ble_stream, older_index = 0 ;
-      bps_older ;
-      bps_older = bps_older->next, older_index++ ) {
+  if ( (nodes = calloc(nodes_num, sizeof(ble_track_node_t))) == NULL ||
+       (starts = calloc(nodes_num, sizeof(ble_track_start_t))) == NULL ||
+       (bonded_starts = calloc(nodes_num, sizeof(int))) == NULL ) {
+    perror("Could not allocate tracking data");
+    exit(ENOMEM);
+  }
 
-    // Search for last GA packet in chain
-    for ( pkt = bps_older->pkt_latest ; pkt && pkt->data_type != BLE_GA_EN ; pkt = pkt->older ) ;
+  // First and last GA packets of every stream are kept by ble_stream_pkt_add()
+  for ( bps = ble_stream, older = 0, starts_num = 0 ; bps ; bps = bps->next, older++ ) {
 
-    if ( !pkt ) continue;
+    nodes[older].bps = bps;
+    nodes[older].start = -1;
+    nodes[older].last_pkt = bps->ga_latest;
 
-    last_pkt = pkt;
+    if ( bps->ga_head ) {
+      starts[starts_num].pkt = bps->ga_head;
+      starts[starts_num++].holder = older;
+    }
+  }
 
-    // Match last packet with first packet belonging to next EN stream
-    for ( bps_newer = ble_stream, newer_index = 0 ;
-        bps_newer ;
-        bps_newer = bps_newer->next, newer_index++ ) {
+  qsort(starts, starts_num, sizeof(ble_track_start_t), ble_track_start_cmp);
 
-      if ( bps_newer == bps_older ) continue;
+  for ( int s = bonded_num = 0 ; s < starts_num ; s++ ) {
 
-      // Search for earliest GA packet in stream
-      next_pkt = NULL;
-      for ( pkt = bps_newer->pkt_latest ; pkt ; pkt = pkt->older ) {
-        if ( pkt->data_type == BLE_GA_EN )
-          next_pkt = pkt;
-      }
+    nodes[starts[s].holder].start = s;
 
-      // No GA packets in this stream
-      if ( !next_pkt ) continue;
+    if ( (starts[s].bk = ble_rpa_resolve_bonded(&starts[s].pkt->bda)) )
+      bonded_starts[bonded_num++] = s;
+  }
 
-      // check bonding
-      for ( bonded = 0, bk = ble_bonding ; bk ; bk = bk->next ) {
+  // Merge streams
+  for ( older = 0 ; older < nodes_num ; older++ ) {
 
-        // Resolved to the same device
-        if ( !ble_resolve_rpa( &next_pkt->bda, bk->irk) &&
-            !ble_resolve_rpa( &last_pkt->bda, bk->irk) ) {
+    if ( !(last_pkt = nodes[older].last_pkt) ) continue;
 
-          bonded = 1;
-          break;
-        }
-      }
+    bk = ble_rpa_resolve_bonded(&last_pkt->bda);
 
-      bps_rpa_gap = 0;
+    newer = match = -1;
+    match_rpa_gap = 0;
 
-      // No bonding, so we guess
-      if ( !bonded ) {
-        // Next packet before our device last packet?
-        if ( next_pkt->recv_time.tv_sec < last_pkt->recv_time.tv_sec ) {
-          continue;
-        }
+    // first start not earlier than our last packet
+    for ( lo = 0, hi = starts_num ; lo < hi ; ) {
 
-        // Too long packet gap?
-        if ( (next_pkt->recv_time.tv_sec - last_pkt->recv_time.tv_sec) > 11 ) {
-          continue;
-        }
+      int mid = (lo + hi) >> 1;
 
-        // Average stream gap too different?
-        older_avg_gap = ( (double)bps_newer->pkt_gap_usum / (double)bps_newer->pkts )/1000000.0;
-        newer_avg_gap = ( (double)bps_older->pkt_gap_usum / (double)bps_older->pkts )/1000000.0;
-        if ( fabs(newer_avg_gap - older_avg_gap) > 50.0 ) { // allowed 50ms diff
-          continue;
-        }
+      if ( starts[mid].pkt->recv_us / 1000000 < last_pkt->recv_us / 1000000 )
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
 
-        // Check RPA interval if it's set
-        if ( bps_newer->rpa_last_change.tv_sec && bps_older->rpa_last_change.tv_sec ) {
-          bps_rpa_gap = labs(tvusec(&bps_newer->rpa_last_change) - tvusec(&bps_older->rpa_last_change));
+    for ( int s = lo ; s < starts_num ; s++ ) {
 
-          // 15min with some variation
-          if ( bps_rpa_gap > 910*1000000 && bps_rpa_gap < 890*1000000 ) continue;
+      st = &starts[s];
 
-        } else {
-          bps_rpa_gap = 0;
-        }
+      if ( st->pkt->recv_us / 1000000 - last_pkt->recv_us / 1000000 > BLE_TRACK_GAP_MAX ) break;
 
-        // RSSI more or less the same?
-        if ( abs(next_pkt->rssi - last_pkt->rssi) > 20 ) {
-          continue;
-        }
-      }
+      if ( st->consumed || st->holder == older ) continue;
 
+      // there is already match earlier on the list
+      if ( newer >= 0 && st->holder > newer ) continue;
 
-      printf("Merging stream %d to %d (%s):\n\t newer - average gap between packets %.3lfs, last RPA change ",
-        older_index, newer_index, bk ? bk->name : "not bonded",
-        ( (double)bps_newer->pkt_gap_usum / (double)bps_newer->pkts )/1000000.0);
-      print_tv(&bps_newer->rpa_last_change);
-      printf(", RPA inverval %.3lfs\n\t  head ", bps_newer->rpa_interval_us/1000000.0 );
-      ble_pkt_print(bps_newer->pkt_head, 0);
-      printf("\n\t  tail ");
-      ble_pkt_print(bps_newer->pkt_latest, 0);
-
-      printf("\n\t older - average gap between packets %.3lfs, last RPA change ",
-        ( (double)bps_older->pkt_gap_usum / (double)bps_older->pkts )/1000000.0);
-      print_tv(&bps_older->rpa_last_change);
-      printf(", RPA inverval %.3lfs\n\t  head ", bps_older->rpa_interval_us/1000000.0 );
-      ble_pkt_print(bps_older->pkt_head, 0);
-      printf("\n\t  tail ");
-      ble_pkt_print(bps_older->pkt_latest, 0);
-
-      printf("\n");
-
-      // If it's the same device, merge older stream to newer
-      pkt = bps_newer->pkt_head;
-
-      pkt->older = bps_older->pkt_latest;
-      pkt->older->newer = pkt;
-
-      bps_newer->pkt_head = bps_older->pkt_head;
-      bps_newer->pkts += bps_older->pkts;
-      bps_newer->pkt_gap_usum += bps_older->pkt_gap_usum;
-      if ( bps_rpa_gap ) bps_newer->rpa_interval_us = bps_rpa_gap;
-
-      // we moving back in time, so copy over from older stream if it's set
-      if ( bps_older->rpa_last_change.tv_sec ) {
-        bps_newer->rpa_last_change.tv_sec = bps_older->rpa_last_change.tv_sec;
-        bps_newer->rpa_last_change.tv_usec = bps_older->rpa_last_change.tv_usec;
+      // Resolved to the same device
+      if ( bk && st->bk == bk ) {
+        bps_rpa_gap = 0;
+      } else if ( !ble_stream_track_guess(nodes[older].bps, last_pkt, nodes[st->holder].bps, st->pkt, &bps_rpa_gap) ) {
+        continue;
       }
 
-      // release older stream
-      bps_older->pkt_head = NULL;
-      bps_older->pkt_latest = NULL;
-      bps_older->pkts = 0;
-      bps_older->pkt_gap_usum = 0;
-      bps_older->rpa_interval_us = 0;
-      memset((void*)&bps_older->rpa_last_change,'0',sizeof(struct timeval));
+      newer = st->holder;
+      match = s;
+      match_rpa_gap = bps_rpa_gap;
+    }
+
+    // Bonded streams match no matter of time
+    for ( int b = 0 ; bk && b < bonded_num ; b++ ) {
 
-      merges++;
+      st = &starts[bonded_starts[b]];
 
-      break;
+      if ( st->bk != bk || st->consumed || st->holder == older ) continue;
+
+      if ( newer < 0 || st->holder < newer ) {
+        newer = st->holder;
+        match = bonded_starts[b];
+        match_rpa_gap = 0;
+      }
     }
+
+    if ( newer < 0 ) continue;
+
+    ble_stream_merge(nodes[older].bps, older, nodes[newer].bps, newer,
+        starts[match].bk == bk ? bk : NULL, match_rpa_gap, verbose);
+
+    // chain of older stream starts newer chain now
+    starts[match].consumed = 1;
+    starts[nodes[older].start].holder = newer;
+    nodes[newer].start = nodes[older].start;
+
+    nodes[older].start = -1;
+    nodes[older].last_pkt = NULL;
+
+    merges++;
   }
 
+  free(bonded_starts);
+  free(starts);
+  free(nodes);
+
 return merges;
 }
 
@@ -590,6 +1067,7 @@ void ble_stream_print() {
 // /*
   ble_pkt_stream_t *bps;
   ble_pkt_t *seen_pkt, *pkt;
+  uint32_t c;
   int i = 0;
 
   printf("\n");
@@ -597,14 +1075,16 @@ void ble_stream_print() {
   for ( bps = ble_stream ; bps ; bps = bps->next, i++ ) {
 
     // Print EN chain
-    for ( pkt = bps->pkt_latest, seen_pkt = NULL ; pkt ; pkt = pkt->older ) {
+    for ( c = bps->cols.num, seen_pkt = NULL ; c-- ; ) {
+
+      pkt = ble_pkt_get(bps->cols.pkt[c]);
 
       if ( pkt->data_type != BLE_GA_EN ) continue;
 
       // Print only not seen data
       if ( !seen_pkt ||
-            memcmp(pkt->data.ga->rpi, seen_pkt->data.ga->rpi, 16) ||
-            memcmp(pkt->data.ga->aem, seen_pkt->data.ga->aem, 4) ||
+            memcmp(pkt->data.ga.rpi, seen_pkt->data.ga.rpi, 16) ||
+            memcmp(pkt->data.ga.aem, seen_pkt->data.ga.aem, 4) ||
             bacmp(&pkt->bda, &seen_pkt->bda) ) {
 
         seen_pkt = pkt;
@@ -693,3 +1173,22 @@ void ble_stream_print() {
 // */
 }
 
+// Per stream statistics computed from packet columns
+void ble_stream_stats() {
+
+  ble_pkt_stream_t *bps;
+  ble_cols_stats_t st;
+  int i = 0;
+
+  for ( bps = ble_stream ; bps ; bps = bps->next, i++ ) {
+
+    if ( !bps->cols.num ) continue;
+
+    ble_cols_stats(&bps->cols, &st);
+
+    printf("Stream %d, packets %u (evicted %u), duration %.3lfs, average gap %.3lfs, RSSI min/avg/max %d/%.1lf/%d, address changes %u\n",
+      i, st.pkts + bps->evicted, bps->evicted, (bps->cols.ts[bps->cols.num - 1] - bps->first_us)/1000000.0,
+      st.gaps ? ( (double)st.gap_usum / (double)st.gaps )/1000000.0 : 0.0,
+      st.rssi_min, st.rssi_avg, st.rssi_max, st.bda_changes);
+  }
+}
@@ -16,6 +16,7 @@
 #include <openssl/err.h>
 
 #include "ble_pkt.h"
+#include "ble_cols.h"
 
 typedef struct ble_bonding_s {
 
@@ -27,36 +28,80 @@ typedef struct ble_bonding_s {
 
   uint8_t irk[16];
 
+  int has_irk;
+  AES_KEY aes_ekey;   // IRK key schedule, prepared by ble_bonding_add()
+
 } ble_bonding_t;
 
 int ble_resolve_rpa(bdaddr_t *bda, uint8_t irk[16]);   // returns zero if valid
+int ble_resolve_rpa_key(bdaddr_t *bda, AES_KEY *aes_ekey);
 int ble_bonding_add(ble_bonding_t *bonding);
 void ble_bonding_print();
 
+#define BLE_PKT_GAP_MAX 10240000   // maximum advertising interval in usec
+#define BLE_TRACK_GAP_MAX 11   // max seconds between streams of the same device
+
 typedef struct ble_pkt_stream_s {
 
   struct ble_pkt_stream_s *prev;
   struct ble_pkt_stream_s *next;
+  struct ble_pkt_stream_s *free_next;   // on free list when stream was released by merge
+
+  ble_cols_t cols;        // stream packets, oldest first
 
-  ble_pkt_t *pkt_head;
-  ble_pkt_t *pkt_latest;
+  ble_pkt_t *ga_head;     // earliest GA packet
+  ble_pkt_t *ga_latest;   // latest GA packet
 
-  // stream metrics
-  uint32_t pkts;
+  // stream metrics, updated as packets are added
+  uint32_t pkts;           // number of gaps accounted below
   uint64_t pkt_gap_usum;   // sum of time gaps between packets in stream in usec
+  uint64_t first_us;       // first packet receive time
+  uint32_t evicted;        // packets dropped by retention policy
 
   struct timeval rpa_last_change;
   uint64_t rpa_interval_us;
 
 } ble_pkt_stream_t;
 
+extern ble_pkt_stream_t *ble_stream;
+
+static inline ble_pkt_t* ble_stream_head( ble_pkt_stream_t *bps ) {
+  return bps->cols.num ? ble_pkt_get(bps->cols.pkt[0]) : NULL;
+}
+
+static inline ble_pkt_t* ble_stream_latest( ble_pkt_stream_t *bps ) {
+  return bps->cols.num ? ble_pkt_get(bps->cols.pkt[bps->cols.num - 1]) : NULL;
+}
+
+// Retention policy for long scans, zero disables limit. Oldest packets are
+// evicted, stream metrics above, its first and last GA packet and its
+// latest packet are kept. Stream not seen for max_age_us, or cut whole by
+// memory budget, is released along with addresses nothing else refers to.
+typedef struct {
+
+  uint64_t max_age_us;        // relative to newest packet
+  uint32_t max_stream_pkts;
+  size_t max_mem;             // everything counted by ble_stream_mem()
+
+} ble_retention_t;
+
+#define BLE_RETAIN_PERIOD_US 10000000   // policy is applied every 10s of capture time
+#define BLE_RETAIN_PKTS 65536           // or after that many packets
+
+extern ble_retention_t ble_retention;
+extern uint64_t ble_retain_expired;
+
+void ble_stream_retain( uint64_t now_us );
+size_t ble_stream_mem();
+
 void ble_stream_free();
 int ble_stream_dump(char *filename);
-int ble_stream_load(char *filename);
+int ble_stream_load(char *filename, uint64_t from_us, uint64_t to_us, int verbose);
 
 int ble_stream_pkt_add( ble_pkt_t *new_pkt);
-int ble_stream_track();
+int ble_stream_track( int verbose );   // merges are printed if verbose
 
 void ble_stream_print();
+void ble_stream_stats();
 
 #endif // __BLE_STREAM_H__
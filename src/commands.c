@@ -65,13 +65,18 @@ return 0;
 
 int cmd_dev( int argc, char **argv) {
 
-  CHECK_ARGS_MAXNUM(1);
+  CHECK_ARGS_MAXNUM(2);
 
   if ( argc == 1 ) {
     hci_for_each_dev(HCI_UP, xhci_dev_info, 0);
     return 0;
   }
 
+  if ( argc == 3 && strcmp(argv[2], "--user") ) {
+    fprintf(stderr, "Unknown option\n");
+    return 1;
+  }
+
   if ( btdev.dev_id != -1 ) {
     memset(&btdev.bda, 0, sizeof(bdaddr_t));
   }
@@ -87,6 +92,9 @@ int cmd_dev( int argc, char **argv) {
     return 1;
   }
 
+  // scan and beacon take device from kernel while they run
+  btdev.user = argc == 3;
+
 return 0;
 }
 
@@ -100,7 +108,7 @@ int cmd_lerandaddr( int argc, char **argv) {
   // Read address if user didn't select device
   if ( (dd = xhci_open_dev(&btdev)) < 0 )
     return -1;
-  hci_close_dev(dd);
+  xhci_close_dev(&btdev, dd);
 
   if ( argc == 1 ) {
     goto print_ba;
@@ -138,6 +146,117 @@ int cmd_resolve_rpa( int argc, char **argv) {
 return 0;
 }
 
+int cmd_bench_rpa( int argc, char **argv) {
+
+  CHECK_ARGS_MAXNUM(1);
+
+  ble_rpa_bench( argc > 1 ? atoi(argv[1]) : 10 );
+
+return 0;
+}
+
+int cmd_bench_ingest( int argc, char **argv) {
+
+  ble_gen_params_t gp;
+  ble_source_t s;
+
+  CHECK_ARGS_MAXNUM(2);
+
+  ble_gen_defaults(&gp);
+  gp.duration_s = 0;
+  gp.reports = 1000000;
+
+  if ( argc > 1 ) gp.reports = strtoull(argv[1], NULL, 10);
+  if ( argc > 2 ) gp.devices = strtoul(argv[2], NULL, 10);
+
+  if ( ble_gen_source(&s, &gp) < 0 )
+    return -1;
+
+return ble_source_bench(&s);
+}
+
+int cmd_bench_retain( int argc, char **argv) {
+
+  ble_retention_t saved = ble_retention;
+  ble_gen_params_t gp;
+  int ret;
+
+  CHECK_ARGS_MAXNUM(2);
+
+  ble_gen_defaults(&gp);
+  gp.devices = 200;
+  gp.duration_s = 6 * 3600;
+  gp.rotate_s = 60;
+
+  if ( argc > 1 ) gp.duration_s = strtod(argv[1], NULL) * 3600;
+  if ( argc > 2 ) gp.devices = strtoul(argv[2], NULL, 10);
+
+  // policy set by 'retention' is used, if there is any
+  if ( !ble_retention.max_age_us && !ble_retention.max_stream_pkts && !ble_retention.max_mem )
+    ble_retention.max_age_us = 600 * 1000000ULL;
+
+  ret = ble_gen_retain(&gp);
+
+  ble_retention = saved;
+
+return ret;
+}
+
+int cmd_gen( int argc, char **argv) {
+
+  ble_gen_params_t gp;
+  char *filename = NULL, *end;
+  double val;
+
+  ble_gen_defaults(&gp);
+
+  for ( int i = 1 ; i < argc ; i++ ) {
+
+    if ( i + 1 == argc ) {
+      fprintf(stderr, "Missing option argument\n");
+      return -1;
+    }
+
+    if ( !strcmp(argv[i], "--write") ) {
+      filename = argv[++i];
+      continue;
+    }
+
+    val = strtod(argv[++i], &end);
+    if ( *end || val < 0 ) {
+      fprintf(stderr, "Invalid value for %s\n", argv[i-1]);
+      return -1;
+    }
+
+    if ( !strcmp(argv[i-1], "--seed") ) {
+      gp.seed = strtoull(argv[i], NULL, 10);
+    } else if ( !strcmp(argv[i-1], "--devices") ) {
+      gp.devices = val;
+    } else if ( !strcmp(argv[i-1], "--duration") ) {
+      gp.duration_s = val;
+    } else if ( !strcmp(argv[i-1], "--interval") ) {
+      gp.interval_ms = val;
+    } else if ( !strcmp(argv[i-1], "--jitter") ) {
+      gp.jitter_ms = val;
+    } else if ( !strcmp(argv[i-1], "--rotate") ) {
+      gp.rotate_s = val;
+    } else if ( !strcmp(argv[i-1], "--lag") ) {
+      gp.lag_ms = val;
+    } else if ( !strcmp(argv[i-1], "--stay") ) {
+      gp.stay_s = val;
+    } else if ( !strcmp(argv[i-1], "--drift") ) {
+      gp.drift = val;
+    } else if ( !strcmp(argv[i-1], "--loss") ) {
+      gp.loss = val / 100.0;
+    } else {
+      fprintf(stderr, "Unknown option\n");
+      return -1;
+    }
+  }
+
+return ble_gen(&gp, filename);
+}
+
 int cmd_beacon( int argc, char **argv) {
 
   CHECK_ARGS_NUM(0);
@@ -180,37 +299,274 @@ return 0;
 
 int cmd_scan( int argc, char **argv) {
 
-  CHECK_ARGS_NUM(0);
+  ble_scan_opts_t opts = { .output = BLE_OUT_ALL };
+
+  for ( int i = 1 ; i < argc ; i++ ) {
+
+    // adapters to scan with
+    if ( strncmp(argv[i], "--", 2) ) {
+
+      if ( opts.dev_num == BLE_SCAN_SRC_MAX ) {
+        fprintf(stderr, "Too many devices\n");
+        return -1;
+      }
+
+      if ( (opts.dev_ids[opts.dev_num++] = hci_devid(argv[i])) < 0 ) {
+        perror("Invalid device");
+        return -1;
+      }
+
+      continue;
+    }
+
+    if ( i + 1 == argc ) {
+      fprintf(stderr, "Missing option argument\n");
+      return -1;
+    }
+
+    if ( !strcmp(argv[i], "--write") ) {
+      opts.capfile = argv[++i];
+    } else if ( !strcmp(argv[i], "--output") ) {
+      if ( ble_out_mode_parse(argv[++i], &opts.output) < 0 ) {
+        fprintf(stderr, "Unknown output mode\n");
+        return -1;
+      }
+    } else {
+      fprintf(stderr, "Unknown option\n");
+      return -1;
+    }
+  }
+
+return ble_scan(&btdev, &opts);
+}
+
+int cmd_replay( int argc, char **argv) {
+
+  ble_scan_opts_t opts = { .output = BLE_OUT_SUMMARY };
+  char *end;
+
+  if ( argc < 2 ) {
+    fprintf(stderr, "Missing file name\n");
+    return -1;
+  }
+
+  for ( int i = 2 ; i < argc ; i++ ) {
+
+    if ( i + 1 == argc ) {
+      fprintf(stderr, "Missing option argument\n");
+      return -1;
+    }
+
+    if ( !strcmp(argv[i], "--speed") ) {
+      opts.speed = strtod(argv[++i], &end);
+      if ( *end || opts.speed < 0 ) {
+        fprintf(stderr, "Invalid speed\n");
+        return -1;
+      }
+    } else if ( !strcmp(argv[i], "--write") ) {
+      opts.capfile = argv[++i];
+    } else if ( !strcmp(argv[i], "--output") ) {
+      if ( ble_out_mode_parse(argv[++i], &opts.output) < 0 ) {
+        fprintf(stderr, "Unknown output mode\n");
+        return -1;
+      }
+    } else {
+      fprintf(stderr, "Unknown option\n");
+      return -1;
+    }
+  }
 
-return ble_scan(&btdev);
+return ble_replay(argv[1], &opts);
 }
 
 int cmd_track( int argc, char **argv) {
 
-  CHECK_ARGS_MAXNUM(2);
+  uint64_t from_us = 0, to_us = 0;
+  int verbose = 0;
+
+  // verbose flag can be given anywhere
+  for ( int i = 1 ; i < argc ; i++ ) {
+    if ( !strcmp(argv[i], "-v") ) {
+      verbose = 1;
+      memmove(&argv[i], &argv[i+1], (argc - i) * sizeof(char*));
+      argc--;
+      break;
+    }
+  }
+
+  CHECK_ARGS_MAXNUM(4);
 
   if ( argc > 1 ) {
 
     if ( !strcmp(argv[1], "--load" ) ) {
-      return ble_stream_load(argv[2]);
+
+      // optional time range, in seconds since epoch
+      if ( argc > 3 ) from_us = strtod(argv[3], NULL) * 1000000.0;
+      if ( argc > 4 ) to_us = strtod(argv[4], NULL) * 1000000.0;
+
+      return ble_stream_load(argv[2], from_us, to_us, verbose);
     }
 
     if ( !strcmp(argv[1], "--dump" ) ) {
       return ble_stream_dump(argv[2]);
     }
 
+    if ( !strcmp(argv[1], "--stats" ) ) {
+      ble_stream_stats();
+      return 0;
+    }
+
+    if ( !strcmp(argv[1], "--truth" ) ) {
+
+      ble_truth_t truth;
+      int ret;
+
+      if ( argc < 3 ) {
+        fprintf(stderr, "Missing file name\n");
+        return -1;
+      }
+
+      ble_truth_init(&truth);
+
+      if ( (ret = ble_truth_load(&truth, argv[2])) == 0 )
+        ret = ble_truth_check(&truth);
+
+      ble_truth_free(&truth);
+
+      return ret;
+    }
+
     fprintf(stderr, "Unknown option\n");
     return -1;
   }
 
-  // Loop until we merge all possible devices
-  while ( ble_stream_track() > 0 ) ;
+  // Merge all possible devices
+  ble_stream_track(1);
 
   ble_stream_print();
 
 return 0;
 }
 
+int cmd_retention( int argc, char **argv) {
+
+  CHECK_ARGS_MAXNUM(6);
+
+  for ( int i = 1 ; i < argc ; i++ ) {
+
+    if ( !strcmp(argv[i], "off") ) {
+      memset(&ble_retention, 0, sizeof(ble_retention));
+      continue;
+    }
+
+    if ( i + 1 >= argc ) {
+      fprintf(stderr, "Missing value for %s\n", argv[i]);
+      return -1;
+    }
+
+    if ( !strcmp(argv[i], "--age") ) {
+      ble_retention.max_age_us = strtod(argv[++i], NULL) * 1000000.0;
+    } else if ( !strcmp(argv[i], "--stream-pkts") ) {
+      ble_retention.max_stream_pkts = strtoul(argv[++i], NULL, 10);
+    } else if ( !strcmp(argv[i], "--memory") ) {
+      ble_retention.max_mem = strtod(argv[++i], NULL) * 1024 * 1024;
+    } else {
+      fprintf(stderr, "Unknown option\n");
+      return -1;
+    }
+  }
+
+  printf("Max age: %.0lfs, max packets per stream: %u, memory budget: %.1lfMB\n",
+    ble_retention.max_age_us/1000000.0, ble_retention.max_stream_pkts,
+    ble_retention.max_mem/(1024.0*1024.0));
+
+  printf("Packets memory in use: %.1lfMB, with streams and addresses: %.1lfMB, expired streams: %lu\n",
+    ble_pkt_mem()/(1024.0*1024.0), ble_stream_mem()/(1024.0*1024.0), (unsigned long)ble_retain_expired);
+
+return 0;
+}
+
+// milliseconds to 0.625ms scan units, 0 if out of range
+static uint16_t scan_units( char *str ) {
+
+  double units = strtod(str, NULL) * 1000.0 / BLE_SCAN_UNITS_US;
+
+  if ( units < BLE_SCAN_INTERVAL_MIN || units > BLE_SCAN_INTERVAL_MAX ) {
+    fprintf(stderr, "Scan interval and window have to be between %g and %gms\n",
+      BLE_SCAN_INTERVAL_MIN * BLE_SCAN_UNITS_US / 1000.0, BLE_SCAN_INTERVAL_MAX * BLE_SCAN_UNITS_US / 1000.0);
+    return 0;
+  }
+
+return units + 0.5;
+}
+
+int cmd_scanparams( int argc, char **argv) {
+
+  ble_scan_params_t sp = ble_scan_params;
+
+  CHECK_ARGS_MAXNUM(11);
+
+  for ( int i = 1 ; i < argc ; i++ ) {
+
+    if ( !strcmp(argv[i], "--active") ) {
+      sp.type = 1;
+      continue;
+    }
+
+    if ( !strcmp(argv[i], "--passive") ) {
+      sp.type = 0;
+      continue;
+    }
+
+    if ( i + 1 >= argc ) {
+      fprintf(stderr, "Missing value for %s\n", argv[i]);
+      return -1;
+    }
+
+    if ( !strcmp(argv[i], "--interval") ) {
+      if ( !(sp.interval = scan_units(argv[++i])) ) return -1;
+    } else if ( !strcmp(argv[i], "--window") ) {
+      if ( !(sp.window = scan_units(argv[++i])) ) return -1;
+    } else if ( !strcmp(argv[i], "--filter") ) {
+      i++;
+      if ( !strcmp(argv[i], "all") ) sp.filter = 0;
+      else if ( !strcmp(argv[i], "whitelist") ) sp.filter = 1;
+      else {
+        fprintf(stderr, "Unknown filter policy\n");
+        return -1;
+      }
+    } else if ( !strcmp(argv[i], "--dup") || !strcmp(argv[i], "--ext") ) {
+      uint8_t *val = argv[i][2] == 'd' ? &sp.filter_dup : &sp.ext;
+      i++;
+      if ( !strcmp(argv[i], "on") ) *val = 1;
+      else if ( !strcmp(argv[i], "off") ) *val = 0;
+      else {
+        fprintf(stderr, "%s is on or off\n", argv[i-1]);
+        return -1;
+      }
+    } else {
+      fprintf(stderr, "Unknown option\n");
+      return -1;
+    }
+  }
+
+  if ( sp.window > sp.interval ) {
+    fprintf(stderr, "Scan window can't be longer than interval\n");
+    return -1;
+  }
+
+  ble_scan_params = sp;
+
+  printf("%s scan, interval: %.3lfms, window: %.3lfms (duty cycle %.0lf%%), filter: %s, duplicates: %s\n",
+    sp.type ? "Active" : "Passive",
+    sp.interval * BLE_SCAN_UNITS_US / 1000.0, sp.window * BLE_SCAN_UNITS_US / 1000.0,
+    sp.window * 100.0 / sp.interval,
+    sp.filter ? "whitelist" : "all", sp.filter_dup ? "dropped by controller" : "reported");
+  printf("Extended scanning: %s\n", sp.ext ? "when supported by controller" : "off");
+
+return 0;
+}
+
 int cmd_ga_rpi( int argc, char **argv) {
 
   int len, i;
@@ -289,8 +645,44 @@ command_t commands[] = {
   {
     .cmd = cmd_scan,
     .name = "scan",
-    .desc = "\n\n"
-      "\tScan for exposure notification beacons (Ctrl-C to stop)\n",
+    .desc = "[hciX ...] [--write FILE] [--output all|changes|summary]\n\n"
+      "\tScan for exposure notification beacons (Ctrl-C to stop)\n\n"
+      "\thciX - Scan with all these adapters at once, packets are merged\n"
+      "\t       in receive time order. Selected device is used by default\n"
+      "\tFILE - Append every report to this binary capture file while\n"
+      "\t       scanning, it can be loaded with 'track --load' even if\n"
+      "\t       scan was interrupted\n"
+      "\t--output - Print every report (default), only new addresses and\n"
+      "\t       RPIs, or table of recently seen devices every second.\n"
+      "\t       Output is rate limited, it never slows down capture\n",
+  },
+  {
+    .cmd = cmd_replay,
+    .name = "replay",
+    .desc = "FILE [--speed X] [--write FILE] [--output all|changes|summary]\n\n"
+      "\tFeed recorded reports through scan pipeline, same as live\n"
+      "\tadapter: HCI events, parsing, packets, streams and output.\n"
+      "\tReports per second and latency of every stage are printed\n"
+      "\twhen replay ends, streams can be tracked afterwards (Ctrl-C to stop)\n\n"
+      "\tFILE - Binary capture or CSV file\n"
+      "\t--speed - Replay at X times recorded rate, 1 is real time.\n"
+      "\t       As fast as possible by default\n"
+      "\t--write - Write replayed reports to binary capture file\n"
+      "\t--output - Same as for scan, summary by default\n",
+  },
+  {
+    .cmd = cmd_scanparams,
+    .name = "scanparams",
+    .desc = "[--interval MS] [--window MS] [--active|--passive] [--filter all|whitelist]\n"
+      "\t[--dup on|off] [--ext on|off]\n\n"
+      "\tSet or display LE scan parameters used by 'scan'\n\n"
+      "\tMS - Scan interval and window in milliseconds, 2.5 to 10240,\n"
+      "\t     window can't be longer than interval\n"
+      "\t--active - Send scan requests, passive scan only listens\n"
+      "\t--filter - Accept advertisements from all devices or whitelist only\n"
+      "\t--dup - Let controller drop duplicate reports\n"
+      "\t--ext - Use LE extended scanning on Bluetooth 5 controllers (default),\n"
+      "\t        legacy scanning is used when it's not supported\n",
   },
   {
     .cmd = cmd_beacon,
@@ -310,11 +702,28 @@ command_t commands[] = {
   {
     .cmd = cmd_track,
     .name = "track",
-    .desc = "[--dump|--load CSVFILE]\n\n"
+    .desc = "[--dump FILE|--load FILE [FROM [TO]] [-v]] [--stats] [--truth FILE]\n\n"
       "\tAnalyze scanned advertisements and try to track devices\n"
       "\tExecute 'scan' first\n\n"
-      "\tCSVFILE - Dump or load scan results to/from this CSV file\n",
+      "\tFILE - Dump or load scan results to/from this file. Files ending\n"
+      "\t       with .csv are CSV, others use binary capture format\n"
+      "\tFROM, TO - Load only packets received in this time range,\n"
+      "\t       in seconds since epoch\n"
+      "\t-v - Print every loaded packet, not only summary\n"
+      "\t--stats - Print packet count, gaps, RSSI and address changes per stream\n"
+      "\t--truth - Track and score streams against ground truth written by 'gen'\n",
     },
+  {
+    .cmd = cmd_retention,
+    .name = "retention",
+    .desc = "[off] [--age SECONDS] [--stream-pkts NUM] [--memory MB]\n\n"
+      "\tSet or display how long scanned packets are kept, zero means no limit\n"
+      "\tOldest packets are evicted, stream statistics are kept\n\n"
+      "\tSECONDS - Drop packets older than that, relative to newest packet.\n"
+      "\t          Streams not seen for that long are released\n"
+      "\tNUM     - Keep at most that many packets in every stream\n"
+      "\tMB      - Memory budget for packets, streams and addresses\n",
+  },
   {
     .cmd = cmd_lerandaddr,
     .name = "lerandaddr",
@@ -327,13 +736,66 @@ command_t commands[] = {
     .desc = "[BDADDR] [IRK]\n\n"
       "\tValidate Random Private Address against 128bit IRK key\n",
   },
+  {
+    .cmd = cmd_bench_rpa,
+    .name = "bench_rpa",
+    .desc = "[ITERATIONS]\n\n"
+      "\tMeasure RPA resolutions per second for 1, 64 and 4096 IRKs\n"
+      "\tusing single key, cached key and batch resolvers\n",
+  },
+  {
+    .cmd = cmd_bench_ingest,
+    .name = "bench_ingest",
+    .desc = "[REPORTS] [DEVICES]\n\n"
+      "\tIngest generated EN reports into empty streams as fast as possible\n"
+      "\tand measure reports per second, captured packets are dropped\n\n"
+      "\tREPORTS - Number of reports, 1000000 by default\n"
+      "\tDEVICES - Number of advertising devices, 1000 by default\n",
+  },
+  {
+    .cmd = cmd_bench_retain,
+    .name = "bench_retain",
+    .desc = "[HOURS] [DEVICES]\n\n"
+      "\tCheck that memory stays flat on long scans. Generated devices change\n"
+      "\taddress every minute, reports go to streams under retention policy\n"
+      "\tand memory is sampled every tenth of run. Fails if it keeps growing\n"
+      "\tafter warm up. Policy set by 'retention' is used, or 10 minutes max age\n\n"
+      "\tHOURS   - Simulated time, 6 by default\n"
+      "\tDEVICES - Number of advertising devices, 200 by default\n",
+  },
+  {
+    .cmd = cmd_gen,
+    .name = "gen",
+    .desc = "[--seed N] [--devices N] [--duration S] [--interval MS] [--jitter MS]\n"
+      "\t[--rotate S] [--lag MS] [--stay S] [--drift DB] [--loss PCT] [--write FILE]\n\n"
+      "\tSimulate EN advertising devices and score tracking against ground truth.\n"
+      "\tSame seed always gives the same reports. Without FILE reports go straight\n"
+      "\tinto streams, then they are tracked and every address change inside\n"
+      "\tstreams is checked\n\n"
+      "\t--seed     - Random seed, 1 by default\n"
+      "\t--devices  - Number of devices, 1000 by default\n"
+      "\t--duration - Simulated seconds, 3600 by default\n"
+      "\t--interval - Advertising interval, 250 ms by default\n"
+      "\t--jitter   - Max random delay added to interval, 10 ms by default\n"
+      "\t--rotate   - Address and RPI change period, 900 s by default\n"
+      "\t--lag      - Change RPI and AEM that long after address, 0 by default\n"
+      "\t--stay     - Devices come and go, staying that long, whole run by default\n"
+      "\t--drift    - Max RSSI change between packets, 0.5 dB by default\n"
+      "\t--loss     - Percent of lost packets, 10 by default\n"
+      "\tFILE - Write binary capture instead, ground truth goes to FILE.truth\n"
+      "\t       (address,device,epoch), load it with 'track --load FILE'\n"
+      "\t       and score with 'track --truth FILE.truth'\n",
+  },
   {
     .cmd = cmd_dev,
     .name = "dev",
-    .desc = "[hciX]\n\n"
+    .desc = "[hciX [--user]]\n\n"
     "\tList bluetooth devices or select HCI device\n"
     "\tIf device is not specified, further commands will\n"
-    "\tbe sent to the first available Bluetooth device\n",
+    "\tbe sent to the first available Bluetooth device\n\n"
+    "\t--user - Take exclusive access to device through HCI user channel\n"
+    "\t         while scanning or advertising, bluetoothd loses it for that\n"
+    "\t         time. Device is brought back up when command ends\n",
   },
   { .cmd = cmd_help,
     .name = "help",
@@ -71,18 +71,53 @@ void printhex(unsigned char *data , int datalen) {
 
 }
 
-void hex2raw( uint8_t *dest, char *src, int len) {
+// Hex digit value plus one, zero for other characters
+static const uint8_t hex_tab[256] = {
+  ['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5,
+  ['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+  ['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+  ['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16,
+};
+
+// Decode up to len bytes, stops at first character which isn't hex digit.
+// Returns number of decoded bytes.
+int hexdecode( uint8_t *dest, const char *src, int len ) {
+
+  const uint8_t *s = (const uint8_t*)src;
+  int i;
+
+  for ( i = 0 ; i < len ; i++, s += 2 ) {
+
+    uint8_t hi = hex_tab[s[0]], lo;
+
+    if ( !hi || !(lo = hex_tab[s[1]]) ) break;
+
+    dest[i] = ((hi - 1) << 4) | (lo - 1);
+  }
+
+return i;
+}
 
-  unsigned int val, i;
+// Lowercase hex without lookups, so compiler can vectorize it.
+// Returns pointer to character after encoded data.
+char* hexencode( char *dest, const uint8_t *src, int len ) {
 
-  for ( i = 0; i < (len << 1) ; i += 2 ) {
+  for ( int i = 0 ; i < len ; i++ ) {
 
-    val = 0;
-    sscanf(src+i, "%02x", &val);
+    uint8_t hi = src[i] >> 4, lo = src[i] & 0xf;
 
-    dest[i >> 1] = val & 0xff;
+    dest[i << 1] = hi + '0' + (hi > 9) * ('a' - '0' - 10);
+    dest[(i << 1) + 1] = lo + '0' + (lo > 9) * ('a' - '0' - 10);
   }
 
+return dest + (len << 1);
+}
+
+void hex2raw( uint8_t *dest, char *src, int len) {
+
+  int i = hexdecode(dest, src, len);
+
+  memset(dest + i, 0, len - i);
 }
 
 void print_tv( struct timeval *tv ) {
@@ -93,10 +128,56 @@ void print_tv( struct timeval *tv ) {
 
 }
 
+void print_usec( uint64_t usec ) {
+
+  struct timeval tv;
+
+  usec2tv(usec, &tv);
+  print_tv(&tv);
+}
+
 uint64_t tvusec( struct timeval *tv ) {
   return tv->tv_sec*1000000 + tv->tv_usec;
 }
 
+void usec2tv( uint64_t usec, struct timeval *tv ) {
+  tv->tv_sec = usec / 1000000;
+  tv->tv_usec = usec % 1000000;
+}
+
+
+uint64_t mono_usec() {
+
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+uint64_t mono_nsec() {
+
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Progress line, redrawn at most 4 times per second
+void print_progress( const char *what, uint64_t done, uint64_t total ) {
+
+  static uint64_t last_us = 0;
+  uint64_t now_us = mono_usec();
+
+  if ( done < total && now_us - last_us < 250000 ) return;
+
+  last_us = now_us;
+
+  printf("\r%s %3d%%", what, total ? (int)(done * 100 / total) : 100);
+  if ( done >= total ) printf("\r\033[K");
+  fflush(stdout);
+}
 
 void print_busyloop() {
 
@@ -22,10 +22,17 @@
 char *hrbytes(char *buf, unsigned int buflen, long long bytes);
 void hexdump(unsigned char *data , int datalen);
 void printhex(unsigned char *data , int datalen);
+int hexdecode( uint8_t *dest, const char *src, int len );
+char* hexencode( char *dest, const uint8_t *src, int len );
 void hex2raw( uint8_t *dest, char *src, int len);
 void print_tv( struct timeval *tv );
+void print_usec( uint64_t usec );
 uint64_t tvusec( struct timeval *tv );
+void usec2tv( uint64_t usec, struct timeval *tv );
 
+uint64_t mono_usec();
+uint64_t mono_nsec();
+void print_progress( const char *what, uint64_t done, uint64_t total );
 void print_busyloop();
 
 #endif // __UTILS_H__